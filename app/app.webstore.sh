@@ -9,6 +9,87 @@ if [ -n "${MULTITHREAD}" ]; then
   MTARG="-t"
 fi
 
+unset TPOOLARG
+if [ -n "${TPOOL}" ]; then
+  TPOOLARG="--tpool ${TPOOL}"
+fi
+
+unset URINGARG
+if [ -n "${URING}" ]; then
+  URINGARG="--uring"
+fi
+
+unset DAEMONSARG
+if [ -n "${DAEMONS}" ]; then
+  DAEMONSARG="--daemons ${DAEMONS}"
+fi
+
+unset RPOOLARG
+if [ -n "${RPOOL}" ]; then
+  RPOOLARG="--rpool ${RPOOL}"
+fi
+
+unset ASYNCARG
+if [ -n "${ASYNC}" ]; then
+  ASYNCARG="--async"
+fi
+
+unset RBATCHARG
+if [ -n "${RWINDOW}" ]; then
+  RBATCHARG="--rwindow ${RWINDOW}"
+  if [ -n "${RBATCH}" ]; then
+    RBATCHARG+=" --rbatch ${RBATCH}"
+  fi
+fi
+
+unset RCLUSTERARG
+if [ -n "${RCLUSTER}" ]; then
+  RCLUSTERARG="--rcluster"
+fi
+
+unset RSHARDARGS
+for SHARD in ${REDISSHARDS}; do
+  RSHARDARGS+=" --rtcp ${SHARD}"
+done
+
+unset LISTENARGS
+for LADDR in ${LISTEN}; do
+  LISTENARGS+=" --listen ${LADDR}"
+done
+
+unset RREPLICAARGS
+for REPLICA in ${REDISREPLICAS}; do
+  RREPLICAARGS+=" --rreplica ${REPLICA}"
+done
+if [ -n "${RREAD}" ]; then
+  RREPLICAARGS+=" --rread ${RREAD}"
+fi
+if [ -n "${RRYW}" ]; then
+  RREPLICAARGS+=" --rryw"
+fi
+
+unset RTIMEOUTARG
+if [ -n "${RTIMEOUT}" ]; then
+  RTIMEOUTARG="--rtimeout ${RTIMEOUT}"
+fi
+
+unset RBREAKERARG
+if [ -n "${RBREAKER}" ]; then
+  RBREAKERARG="--rbreaker ${RBREAKER}"
+fi
+
+unset STREAMARG
+if [ -n "${STREAMFWD}" ]; then
+  STREAMARG="--sfwd"
+elif [ -n "${STREAMPOST}" ]; then
+  STREAMARG="--stream"
+fi
+
+unset SGETARG
+if [ -n "${STREAMGET}" ]; then
+  SGETARG="--sget ${STREAMGET}"
+fi
+
 unset CERTPATH
 unset KEYPATH
 unset CERTARG
@@ -34,6 +115,7 @@ if [ -n "${MAXPOSTSIZE}" ]; then
 fi
 
 exec /app/webstore.exe -P ${HTTPPORT} \
---rtcp ${REDISIP}:${REDISPORT} \
--l /log/webstore.log \
-${MTARG} ${CERTARG} ${KEYARG} ${DSIZEARG}
+--rtcp ${REDISIP}:${REDISPORT} ${RSHARDARGS} \
+-l /log/webstore.log ${LISTENARGS} \
+${MTARG} ${TPOOLARG} ${URINGARG} ${DAEMONSARG} ${RPOOLARG} ${ASYNCARG} ${RBATCHARG} ${RCLUSTERARG} ${RREPLICAARGS} ${RTIMEOUTARG} ${RBREAKERARG} ${STREAMARG} ${SGETARG} \
+${CERTARG} ${KEYARG} ${DSIZEARG}
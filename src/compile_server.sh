@@ -9,12 +9,16 @@ OPTCFLAGS="${CFLAGS} ${OPT}"
 DBGCFLAGS="${CFLAGS} ${DBG}"
 # DBGCFLAGS+=" -DSRNODECHRONOMETRY"
 
+# The io_uring engine (--uring) requires liburing
+URING=""
+# URING="-DSEARESTURING -luring"
+
 rm -f *.exe *.dbg
 
-gcc ${OPTCFLAGS} webstore*.c getopts.c searest*.c rai.c futils.c \
--lpthread -lmicrohttpd -lhiredis -o webstore.exe
+gcc ${OPTCFLAGS} webstore*.c getopts.c searest*.c rai*.c futils.c \
+-lpthread -lmicrohttpd -lhiredis ${URING} -o webstore.exe
 
-gcc ${DBGCFLAGS} webstore*.c getopts.c searest*.c rai.c futils.c chronometry.c \
--lpthread -lmicrohttpd -lhiredis -o webstore.dbg
+gcc ${DBGCFLAGS} webstore*.c getopts.c searest*.c rai*.c futils.c chronometry.c \
+-lpthread -lmicrohttpd -lhiredis ${URING} -o webstore.dbg
 
 strip *.exe
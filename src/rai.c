@@ -25,11 +25,57 @@
 #endif
 */
 
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 
 #include "rai.h"
 
+long long rai_now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((long long)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+// Exponential backoff with jitter, so that every context does not reconnect at once
+// return how long to wait (ms) and double the backoff for next time
+int rai_backoff(int *backoff)
+{
+	static __thread unsigned int seed = 0;
+	int wait;
+
+	if(!seed) { seed = (unsigned int)rai_now_ms() ^ (unsigned int)(size_t)&seed; }
+
+	if(*backoff < RAI_BACKOFF_MIN_MS) { *backoff = RAI_BACKOFF_MIN_MS; }
+	wait = (*backoff / 2) + (rand_r(&seed) % (*backoff / 2 + 1));
+
+	*backoff *= 2;
+	if(*backoff > RAI_BACKOFF_MAX_MS) { *backoff = RAI_BACKOFF_MAX_MS; }
+
+	return wait;
+}
+
+static redisContext* rai_open(rai_t *r)
+{
+	struct timeval tv;
+	redisContext *c;
+
+	// Never wait forever on a dead host when we have a timeout
+	if(r->timeout.tv_sec || r->timeout.tv_usec) {
+		tv = r->timeout;
+		if(r->port) c = redisConnectWithTimeout(r->dest, r->port, tv);
+		else	c = redisConnectUnixWithTimeout(r->dest, tv);
+		if(c && !c->err) { redisSetTimeout(c, r->timeout); }
+	} else {
+		if(r->port) c = redisConnect(r->dest, r->port);
+		else	c = redisConnectUnix(r->dest);
+	}
+
+	return c;
+}
+
 void rai_lock(rai_t *r)
 {
 	pthread_mutex_lock(&r->rl);
@@ -55,8 +101,9 @@ int rai_connect(rai_t *r, char *dest, unsigned short port)
 		return -2;
 	}
 
-	if(port) r->c = redisConnect(dest, port);
-	else	r->c = redisConnectUnix(dest);
+	r->dest = strdup(dest);
+	r->port = port;
+	r->c = rai_open(r);
 
 	if(!r->c) {
 		//fprintf(stderr, "Connection error: can't allocate redis context\n");
@@ -74,6 +121,49 @@ int rai_connect(rai_t *r, char *dest, unsigned short port)
 	return 0;
 }
 
+// Apply a timeout to every command, a timed out context will be reconnected
+void rai_set_timeout(rai_t *r, long ms)
+{
+	rai_lock(r);
+	r->timeout.tv_sec = ms / 1000;
+	r->timeout.tv_usec = (ms % 1000) * 1000;
+	if(r->c && !r->c->err) { redisSetTimeout(r->c, r->timeout); }
+	rai_unlock(r);
+}
+
+// Make sure our redis handle is usable, reconnecting if it has failed
+// Must be called with the lock held
+// A failed handle is kept until a reconnect succeeds, commands on it fail immediately
+// return 0 if the handle is usable
+// return -1 means we are still backing off from the last attempt
+// return -4 means the reconnect failed
+int rai_check_connection(rai_t *r)
+{
+	long long now;
+	redisContext *c;
+
+	if(r->c && !r->c->err) { return 0; }
+
+	now = rai_now_ms();
+	if(now < r->retry_at) { return -1; }
+
+	r->connected = 0;
+	c = rai_open(r);
+	if(!c || c->err) {
+		if(c) { redisFree(c); }
+		r->retry_at = now + rai_backoff(&r->backoff);
+		return -4;
+	}
+
+	if(r->c) { redisFree(r->c); }
+	r->c = c;
+	r->backoff = 0;
+	r->retry_at = 0;
+	r->reported = 0;
+	r->connected = 1;
+	return 0;
+}
+
 // returns the last known state of our redis handle
 int rai_is_connected(rai_t *r)
 {
@@ -86,7 +176,127 @@ void rai_disconnect(rai_t *r)
 
 	//Disconnects and frees the context
 	if(r->c) { redisFree(r->c); r->c = NULL; }
+	if(r->dest) { free(r->dest); r->dest = NULL; }
 	r->connected = 0;
 
 	rai_unlock(r);
 }
+
+// Every thread gets a home slot the first time it touches a pool
+// A thread will keep using the same context unless another thread is holding it
+static int g_raip_next_slot = 0;
+static __thread int t_raip_slot = -1;
+
+static inline int raip_home_slot(raip_t *p)
+{
+	if(t_raip_slot < 0) { t_raip_slot = __sync_fetch_and_add(&g_raip_next_slot, 1); }
+	return (t_raip_slot % p->size);
+}
+
+// return 0 on success
+// return -5 means we could not allocate the pool
+// any other error is passed along from rai_connect()
+int raip_connect(raip_t *p, int size, char *dest, unsigned short port)
+{
+	int i, z;
+
+	if(size < 1) { size = 1; }
+	p->conns = calloc(size, sizeof(rai_t));
+	if(!p->conns) { return -5; }
+	p->size = size;
+
+	for(i=0; i<size; i++) {
+		z = rai_connect(&p->conns[i], dest, port);
+		if(z) { raip_disconnect(p); return z; }
+	}
+
+	return 0;
+}
+
+// Lock and return a context for exclusive use
+// Try our home slot first, then any idle context, then wait on our home slot
+// this must be returned with raip_checkin()
+rai_t* raip_checkout(raip_t *p)
+{
+	int i, home, n;
+	rai_t *r;
+
+	home = raip_home_slot(p);
+	for(i=0; i<p->size; i++) {
+		n = (home + i) % p->size;
+		r = &p->conns[n];
+		if(pthread_mutex_trylock(&r->rl) == 0) {
+			rai_check_connection(r);
+			return r;
+		}
+	}
+
+	r = &p->conns[home];
+	rai_lock(r);
+	rai_check_connection(r);
+	return r;
+}
+
+void raip_checkin(raip_t *p, rai_t *r)
+{
+	rai_unlock(r);
+}
+
+void raip_set_timeout(raip_t *p, long ms)
+{
+	int i;
+
+	for(i=0; i<p->size; i++) { rai_set_timeout(&p->conns[i], ms); }
+}
+
+void raip_disconnect(raip_t *p)
+{
+	int i;
+
+	if(!p->conns) { return; }
+	for(i=0; i<p->size; i++) {
+		if(p->conns[i].connected || p->conns[i].c || p->conns[i].dest) { rai_disconnect(&p->conns[i]); }
+	}
+	free(p->conns);
+	p->conns = NULL;
+	p->size = 0;
+}
+
+// threshold 0 disables the breaker
+void raicb_init(raicb_t *cb, int threshold, int cooldown)
+{
+	cb->failures = 0;
+	cb->threshold = threshold;
+	cb->cooldown = cooldown;
+	cb->open_until = 0;
+}
+
+// return 1 if a request may go to redis
+// return 0 if the breaker is open and the request should fail fast
+int raicb_allow(raicb_t *cb)
+{
+	long long now, until;
+
+	if(cb->threshold < 1) { return 1; }
+	if(__atomic_load_n(&cb->failures, __ATOMIC_RELAXED) < cb->threshold) { return 1; }
+
+	// Half open: the first caller after the cooldown is the probe
+	now = rai_now_ms();
+	until = __atomic_load_n(&cb->open_until, __ATOMIC_RELAXED);
+	if(now < until) { return 0; }
+	return __sync_bool_compare_and_swap(&cb->open_until, until, now + cb->cooldown);
+}
+
+void raicb_success(raicb_t *cb)
+{
+	if(__atomic_load_n(&cb->failures, __ATOMIC_RELAXED)) { __atomic_store_n(&cb->failures, 0, __ATOMIC_RELAXED); }
+}
+
+// return 1 if this failure opened the breaker
+int raicb_failure(raicb_t *cb)
+{
+	if(cb->threshold < 1) { return 0; }
+	if(__sync_add_and_fetch(&cb->failures, 1) != cb->threshold) { return 0; }
+	__atomic_store_n(&cb->open_until, rai_now_ms() + cb->cooldown, __ATOMIC_RELAXED);
+	return 1;
+}
@@ -21,18 +21,57 @@
 #include <pthread.h>
 #include <hiredis/hiredis.h>
 
+#define RAI_BACKOFF_MIN_MS	(10)
+#define RAI_BACKOFF_MAX_MS	(2000)
+
 typedef struct {
 	redisContext *c;
 	pthread_mutex_t rl;
 	int connected;
+	char *dest;
+	unsigned short port;
+	struct timeval timeout;		// Command timeout (0 means none)
+	long long retry_at;			// Do not reconnect before this time (ms)
+	int backoff;				// Current reconnect backoff (ms)
+	int reported;				// The current failure has been reported, cleared by a reconnect
 } rai_t;
 
+// A sized pool of redis contexts to the same destination
+typedef struct {
+	rai_t *conns;
+	int size;
+} raip_t;
+
+// Fail fast while redis is down
+// After threshold consecutive failures, only one probe is let through every cooldown ms
+typedef struct {
+	int failures;
+	int threshold;
+	int cooldown;
+	long long open_until;
+} raicb_t;
+
+long long rai_now_ms(void);
+int rai_backoff(int *backoff);
+
 void rai_lock(rai_t *r);
 void rai_unlock(rai_t *r);
 
 int rai_connect(rai_t *r, char *dest, unsigned short port);
+void rai_set_timeout(rai_t *r, long ms);
 int rai_check_connection(rai_t *r);
 int rai_is_connected(rai_t *r);
 void rai_disconnect(rai_t *r);
 
+int raip_connect(raip_t *p, int size, char *dest, unsigned short port);
+rai_t* raip_checkout(raip_t *p);
+void raip_checkin(raip_t *p, rai_t *r);
+void raip_set_timeout(raip_t *p, long ms);
+void raip_disconnect(raip_t *p);
+
+void raicb_init(raicb_t *cb, int threshold, int cooldown);
+int raicb_allow(raicb_t *cb);
+void raicb_success(raicb_t *cb);
+int raicb_failure(raicb_t *cb);
+
 #endif
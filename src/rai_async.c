@@ -0,0 +1,265 @@
+/*
+	Copyright (C) 2021 Brett Kuskie <fullaxx@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; version 2 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// hiredis does not ship an event loop of its own
+// This is a minimal poll() based adapter, running in a dedicated thread
+// Commands may be submitted from any thread, the loop is woken up through a pipe
+// If the connection drops, the loop reconnects with backoff; commands fail until it is back
+
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include "rai_async.h"
+
+static void raia_wake(raia_t *a)
+{
+	char c = 0;
+	if(write(a->wakefd[1], &c, 1) < 0) { /* the loop is already awake */ }
+}
+
+static void raia_add_read(void *privdata)
+{
+	raia_t *a = privdata;
+	a->reading = 1;
+	raia_wake(a);
+}
+
+static void raia_del_read(void *privdata)
+{
+	raia_t *a = privdata;
+	a->reading = 0;
+}
+
+static void raia_add_write(void *privdata)
+{
+	raia_t *a = privdata;
+	a->writing = 1;
+	raia_wake(a);
+}
+
+static void raia_del_write(void *privdata)
+{
+	raia_t *a = privdata;
+	a->writing = 0;
+}
+
+// hiredis is about to free the async context
+static void raia_cleanup(void *privdata)
+{
+	raia_t *a = privdata;
+	a->reading = 0;
+	a->writing = 0;
+	a->ac = NULL;
+}
+
+// hiredis will free the context after this returns, the loop will reconnect
+static void raia_on_disconnect(const redisAsyncContext *ac, int status)
+{
+	raia_t *a = ac->data;
+	if(status == REDIS_OK) { return; }
+	if(!a) { return; }
+	if(a->disconnect_cb) { a->disconnect_cb(ac->errstr); }
+	a->retry_at = rai_now_ms() + rai_backoff(&a->backoff);
+}
+
+static void raia_on_connect(const redisAsyncContext *ac, int status)
+{
+	raia_t *a = ac->data;
+	if(!a) { return; }
+	if(status == REDIS_OK) { a->backoff = 0; return; }
+	if(a->disconnect_cb) { a->disconnect_cb(ac->errstr); }
+	a->retry_at = rai_now_ms() + rai_backoff(&a->backoff);
+}
+
+// Create a new async context and hook it into our loop
+// Must be called with the lock held
+// return 0 on success
+static int raia_attach(raia_t *a)
+{
+	if(a->port) a->ac = redisAsyncConnect(a->dest, a->port);
+	else	a->ac = redisAsyncConnectUnix(a->dest);
+
+	if(!a->ac) { return -3; }
+	if(a->ac->err) {
+		redisAsyncFree(a->ac);
+		a->ac = NULL;
+		return -4;
+	}
+
+	a->reading = 0;
+	a->writing = 0;
+	a->ac->data = a;
+	a->ac->ev.data = a;
+	a->ac->ev.addRead = &raia_add_read;
+	a->ac->ev.delRead = &raia_del_read;
+	a->ac->ev.addWrite = &raia_add_write;
+	a->ac->ev.delWrite = &raia_del_write;
+	a->ac->ev.cleanup = &raia_cleanup;
+	redisAsyncSetConnectCallback(a->ac, &raia_on_connect);
+	redisAsyncSetDisconnectCallback(a->ac, &raia_on_disconnect);
+
+	return 0;
+}
+
+static void* raia_loop(void *arg)
+{
+	raia_t *a = arg;
+	struct pollfd pfd[2];
+	char drain[64];
+	int n, nfds, timeout;
+	long long now;
+
+	while(a->running) {
+		pthread_mutex_lock(&a->al);
+		timeout = 1000;
+		if(!a->ac) {
+			now = rai_now_ms();
+			if(now >= a->retry_at) {
+				if(raia_attach(a)) { a->retry_at = now + rai_backoff(&a->backoff); }
+			}
+			if(!a->ac && (a->retry_at - now < timeout)) { timeout = (a->retry_at > now) ? (a->retry_at - now) : 0; }
+		}
+		pfd[0].fd = a->wakefd[0];
+		pfd[0].events = POLLIN;
+		pfd[0].revents = 0;
+		nfds = 1;
+		if(a->ac && (a->reading || a->writing)) {
+			pfd[1].fd = a->ac->c.fd;
+			pfd[1].events = (a->reading ? POLLIN : 0) | (a->writing ? POLLOUT : 0);
+			pfd[1].revents = 0;
+			nfds = 2;
+		}
+		pthread_mutex_unlock(&a->al);
+
+		n = poll(pfd, nfds, timeout);
+		if(n <= 0) { continue; }
+
+		if(pfd[0].revents & POLLIN) {
+			while(read(a->wakefd[0], drain, sizeof(drain)) > 0) { }
+		}
+		if(nfds < 2) { continue; }
+
+		pthread_mutex_lock(&a->al);
+		if(a->ac && a->reading && (pfd[1].revents & (POLLIN|POLLERR|POLLHUP))) {
+			redisAsyncHandleRead(a->ac);
+		}
+		if(a->ac && a->writing && (pfd[1].revents & (POLLOUT|POLLERR|POLLHUP))) {
+			redisAsyncHandleWrite(a->ac);
+		}
+		pthread_mutex_unlock(&a->al);
+	}
+
+	return NULL;
+}
+
+// return -2 means pthread_mutex_init() failed, bail
+// return -3 means redisAsyncConnect() failed, bail
+// return -4 means there was an connetion error during redisAsyncConnect()
+// return -5 means we could not create the wake pipe
+// return -6 means we could not start the event loop thread
+int raia_connect(raia_t *a, char *dest, unsigned short port, void *disconnect_cb)
+{
+	int z;
+
+	z = pthread_mutex_init(&a->al, NULL);
+	if(z) { return -2; }
+
+	a->dest = strdup(dest);
+	a->port = port;
+	a->disconnect_cb = disconnect_cb;
+	z = raia_attach(a);
+	if(z) { return z; }
+
+	if(pipe(a->wakefd)) {
+		redisAsyncFree(a->ac);
+		a->ac = NULL;
+		return -5;
+	}
+	fcntl(a->wakefd[0], F_SETFL, O_NONBLOCK);
+	fcntl(a->wakefd[1], F_SETFL, O_NONBLOCK);
+
+	a->running = 1;
+	z = pthread_create(&a->thread, NULL, &raia_loop, a);
+	if(z) {
+		a->running = 0;
+		redisAsyncFree(a->ac);
+		close(a->wakefd[0]);
+		close(a->wakefd[1]);
+		return -6;
+	}
+
+	return 0;
+}
+
+// Queue a command to be written by the event loop
+// fn will be called from the event loop thread with the reply
+// return REDIS_OK on success
+int raia_command(raia_t *a, redisCallbackFn *fn, void *privdata, const char *format, ...)
+{
+	int z = REDIS_ERR;
+	va_list ap;
+
+	pthread_mutex_lock(&a->al);
+	if(a->ac) {
+		va_start(ap, format);
+		z = redisvAsyncCommand(a->ac, fn, privdata, format, ap);
+		va_end(ap);
+	}
+	pthread_mutex_unlock(&a->al);
+
+	return z;
+}
+
+// Same as raia_command() with length-delimited (binary-safe) arguments
+// hiredis copies the arguments, they may be released once this returns
+int raia_command_argv(raia_t *a, redisCallbackFn *fn, void *privdata, int argc, const char **argv, const size_t *argvlen)
+{
+	int z = REDIS_ERR;
+
+	pthread_mutex_lock(&a->al);
+	if(a->ac) { z = redisAsyncCommandArgv(a->ac, fn, privdata, argc, argv, argvlen); }
+	pthread_mutex_unlock(&a->al);
+
+	return z;
+}
+
+// Stop the event loop and free the context
+// All pending callbacks will be called with a NULL reply from this thread
+void raia_disconnect(raia_t *a)
+{
+	if(!a->running) { return; }
+
+	pthread_mutex_lock(&a->al);
+	a->running = 0;
+	raia_wake(a);
+	pthread_mutex_unlock(&a->al);
+	pthread_join(a->thread, NULL);
+
+	pthread_mutex_lock(&a->al);
+	a->disconnect_cb = NULL;
+	if(a->ac) { redisAsyncFree(a->ac); }
+	pthread_mutex_unlock(&a->al);
+
+	close(a->wakefd[0]);
+	close(a->wakefd[1]);
+	free(a->dest);
+	a->dest = NULL;
+}
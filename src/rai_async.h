@@ -0,0 +1,51 @@
+/*
+	Copyright (C) 2021 Brett Kuskie <fullaxx@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; version 2 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __REDIS_ADVANCED_INTERFACE_ASYNC_H__
+#define __REDIS_ADVANCED_INTERFACE_ASYNC_H__
+
+#include <pthread.h>
+#include <hiredis/hiredis.h>
+#include <hiredis/async.h>
+
+#include "rai.h"
+
+#define RAIA_DISCONNECT_CALLBACK(CB)	void (CB)(const char *);
+
+// An async redis context driven by its own event loop thread
+// Reply callbacks are called from the event loop thread
+typedef struct {
+	redisAsyncContext *ac;
+	pthread_mutex_t al;
+	pthread_t thread;
+	int wakefd[2];
+	int reading;
+	int writing;
+	int running;
+	char *dest;
+	unsigned short port;
+	long long retry_at;		// Do not reconnect before this time (ms)
+	int backoff;			// Current reconnect backoff (ms)
+	RAIA_DISCONNECT_CALLBACK(*disconnect_cb);
+} raia_t;
+
+int raia_connect(raia_t *a, char *dest, unsigned short port, void *disconnect_cb);
+int raia_command(raia_t *a, redisCallbackFn *fn, void *privdata, const char *format, ...);
+int raia_command_argv(raia_t *a, redisCallbackFn *fn, void *privdata, int argc, const char **argv, const size_t *argvlen);
+void raia_disconnect(raia_t *a);
+
+#endif
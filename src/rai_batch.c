@@ -0,0 +1,155 @@
+/*
+	Copyright (C) 2021 Brett Kuskie <fullaxx@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; version 2 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// The first thread to arrive at an empty queue becomes the leader
+// The leader waits (at most window_us) for other threads to queue their commands,
+// then sends the whole batch with redisAppendCommandArgv() and reads all the replies back.
+// Every other thread sleeps until the leader has filled in its reply.
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "rai_batch.h"
+
+// return 0 on success
+// return -2 means pthread_mutex_init() failed
+// return -3 means pthread_cond_init() failed
+int raib_init(raib_t *b, raip_t *pool, long window_us, int max_ops, void *err_cb)
+{
+	int z;
+	pthread_condattr_t ca;
+
+	memset(b, 0, sizeof(raib_t));
+	b->pool = pool;
+	b->window_us = window_us;
+	b->max_ops = (max_ops > 0) ? max_ops : 1;
+	b->err_cb = err_cb;
+
+	z = pthread_mutex_init(&b->bl, NULL);
+	if(z) { return -2; }
+
+	pthread_condattr_init(&ca);
+	pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+	z = pthread_cond_init(&b->full, &ca);
+	if(!z) { z = pthread_cond_init(&b->done, NULL); }
+	pthread_condattr_destroy(&ca);
+	if(z) { return -3; }
+
+	return 0;
+}
+
+// Pipeline the batch on a single context
+// On a redis error, the remaining ops get a NULL reply
+static void raib_flush(raib_t *b, raib_op_t *batch)
+{
+	int z = REDIS_OK;
+	int n = 0;
+	raib_op_t *cursor;
+	rai_t *rc;
+
+	rc = raip_checkout(b->pool);
+
+	for(cursor = batch; cursor && (z == REDIS_OK); cursor = cursor->next) {
+		z = redisAppendCommandArgv(rc->c, cursor->argc, cursor->argv, cursor->argvlen);
+		if(z == REDIS_OK) { n++; }
+	}
+
+	// redisGetReply() writes out the whole pipeline before the first read
+	for(cursor = batch; cursor && (n > 0); cursor = cursor->next, n--) {
+		if(redisGetReply(rc->c, (void **)&cursor->reply) != REDIS_OK) {
+			cursor->reply = NULL;
+			z = REDIS_ERR;
+			break;
+		}
+	}
+
+	if((z != REDIS_OK) && b->err_cb) { b->err_cb(rc); }
+	raip_checkin(b->pool, rc);
+}
+
+static inline void deadline_after(struct timespec *ts, long usec)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	ts->tv_sec += usec / 1000000;
+	ts->tv_nsec += (usec % 1000000) * 1000;
+	if(ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+// Run a command as part of a batch and wait for its reply
+// return NULL on a redis error (err_cb has already been called)
+redisReply* raib_command_argv(raib_t *b, int argc, const char **argv, const size_t *argvlen)
+{
+	raib_op_t op;
+	raib_op_t *batch, *cursor, *next;
+	struct timespec deadline;
+
+	memset(&op, 0, sizeof(op));
+	op.argc = argc;
+	op.argv = argv;
+	op.argvlen = argvlen;
+
+	pthread_mutex_lock(&b->bl);
+	if(b->tail) { b->tail->next = &op; }
+	else { b->head = &op; }
+	b->tail = &op;
+	b->count++;
+
+	// Someone else is gathering this batch, wake them up if it is full
+	if(b->leader) {
+		if(b->count >= b->max_ops) { pthread_cond_signal(&b->full); }
+		while(!op.done) { pthread_cond_wait(&b->done, &b->bl); }
+		pthread_mutex_unlock(&b->bl);
+		return op.reply;
+	}
+
+	// We lead this batch, wait for company until the window closes or the batch is full
+	b->leader = 1;
+	deadline_after(&deadline, b->window_us);
+	while(b->count < b->max_ops) {
+		if(pthread_cond_timedwait(&b->full, &b->bl, &deadline) == ETIMEDOUT) { break; }
+	}
+
+	// Take the batch, the next thread to arrive will lead the next one
+	batch = b->head;
+	b->head = b->tail = NULL;
+	b->count = 0;
+	b->leader = 0;
+	pthread_mutex_unlock(&b->bl);
+
+	raib_flush(b, batch);
+
+	pthread_mutex_lock(&b->bl);
+	for(cursor = batch; cursor; cursor = next) {
+		next = cursor->next;
+		cursor->done = 1;
+	}
+	pthread_cond_broadcast(&b->done);
+	pthread_mutex_unlock(&b->bl);
+
+	return op.reply;
+}
+
+void raib_destroy(raib_t *b)
+{
+	pthread_cond_destroy(&b->full);
+	pthread_cond_destroy(&b->done);
+	pthread_mutex_destroy(&b->bl);
+}
@@ -0,0 +1,55 @@
+/*
+	Copyright (C) 2021 Brett Kuskie <fullaxx@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; version 2 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __REDIS_ADVANCED_INTERFACE_BATCH_H__
+#define __REDIS_ADVANCED_INTERFACE_BATCH_H__
+
+#include "rai.h"
+
+#define RAIB_ERROR_CALLBACK(CB)	void (CB)(rai_t *);
+
+// One queued command, it lives on the stack of the thread waiting for it
+typedef struct raib_op {
+	int argc;
+	const char **argv;
+	const size_t *argvlen;
+	redisReply *reply;
+	int done;
+	struct raib_op *next;
+} raib_op_t;
+
+// Group commit: commands arriving within window_us of each other (up to max_ops)
+// are pipelined together on one pooled context
+typedef struct {
+	raip_t *pool;
+	pthread_mutex_t bl;
+	pthread_cond_t full;
+	pthread_cond_t done;
+	raib_op_t *head;
+	raib_op_t *tail;
+	int count;
+	int leader;
+	long window_us;
+	int max_ops;
+	RAIB_ERROR_CALLBACK(*err_cb);
+} raib_t;
+
+int raib_init(raib_t *b, raip_t *pool, long window_us, int max_ops, void *err_cb);
+redisReply* raib_command_argv(raib_t *b, int argc, const char **argv, const size_t *argvlen);
+void raib_destroy(raib_t *b);
+
+#endif
@@ -0,0 +1,470 @@
+/*
+	Copyright (C) 2021 Brett Kuskie <fullaxx@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; version 2 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// Keys are mapped onto 16384 hash slots, every slot is served by one master.
+// We learn the slot map with CLUSTER SLOTS and keep a pool of contexts per master.
+// MOVED means the slot map changed, so we reload it and try again.
+// ASK means the slot is being migrated, so we send this one command (after ASKING) to the new owner.
+// A connection error may mean a master failed over, so we reload the slot map from the other nodes.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "rai_cluster.h"
+
+// CRC16-CCITT (XMODEM) as used by redis cluster
+static uint16_t crc16(const char *buf, size_t len)
+{
+	size_t i;
+	int j;
+	uint16_t crc = 0;
+
+	for(i=0; i<len; i++) {
+		crc ^= ((uint16_t)(unsigned char)buf[i]) << 8;
+		for(j=0; j<8; j++) {
+			if(crc & 0x8000) { crc = (crc << 1) ^ 0x1021; }
+			else { crc = (crc << 1); }
+		}
+	}
+
+	return crc;
+}
+
+// Only the part of the key inside the first {...} is hashed, if it is not empty
+unsigned int raic_keyslot(const char *key, size_t keylen)
+{
+	size_t s, e;
+
+	for(s=0; s<keylen; s++) {
+		if(key[s] == '{') { break; }
+	}
+	if(s == keylen) { return crc16(key, keylen) & (RAIC_SLOTS-1); }
+
+	for(e=s+1; e<keylen; e++) {
+		if(key[e] == '}') { break; }
+	}
+	if((e == keylen) || (e == s+1)) { return crc16(key, keylen) & (RAIC_SLOTS-1); }
+
+	return crc16(key+s+1, e-s-1) & (RAIC_SLOTS-1);
+}
+
+// Find a node by address
+// Must be called with the lock held (read or write)
+// return the node index, or -1 if we have not seen it
+static int raic_node_find(raic_t *cl, const char *host, unsigned short port)
+{
+	int i;
+	raic_node_t *n;
+
+	for(i=0; i<cl->nodecount; i++) {
+		n = cl->nodes[i];
+		if((n->port == port) && (strcmp(n->host, host) == 0)) { return i; }
+	}
+
+	return -1;
+}
+
+static void raic_node_free(raic_node_t *n)
+{
+	raip_disconnect(&n->pool);
+	free(n->host);
+	free(n);
+}
+
+// Find a node by address, connect to it if we have not seen it before
+// The connection is made without the lock, so a slow or dead node never stalls routing
+// return the node index, or -1 on failure
+static int raic_node_get(raic_t *cl, const char *host, unsigned short port)
+{
+	int i, z;
+	raic_node_t *n;
+
+	pthread_rwlock_rdlock(&cl->cl);
+	i = raic_node_find(cl, host, port);
+	z = (cl->nodecount >= RAIC_MAX_NODES);
+	pthread_rwlock_unlock(&cl->cl);
+	if(i >= 0) { return i; }
+	if(z) { return -1; }
+
+	n = calloc(1, sizeof(raic_node_t));
+	if(!n) { return -1; }
+	n->host = strdup(host);
+	n->port = port;
+	z = raip_connect(&n->pool, cl->poolsize, n->host, n->port);
+	if(z) {
+		free(n->host);
+		free(n);
+		return -1;
+	}
+
+	// Another thread may have added the same node while we were connecting
+	pthread_rwlock_wrlock(&cl->cl);
+	i = raic_node_find(cl, host, port);
+	if((i < 0) && (cl->nodecount < RAIC_MAX_NODES)) {
+		if(cl->timeout > 0) { raip_set_timeout(&n->pool, cl->timeout); }
+		cl->nodes[cl->nodecount] = n;
+		i = cl->nodecount++;
+		n = NULL;
+	}
+	pthread_rwlock_unlock(&cl->cl);
+
+	if(n) { raic_node_free(n); }
+	return i;
+}
+
+// Ask a node for the current slot map and apply it
+// CLUSTER SLOTS and any new connections happen outside the lock, the write lock is only taken to swap the map in
+// Must be called with cl->rl held
+// return 0 on success
+static int raic_load_slots(raic_t *cl, raic_node_t *from)
+{
+	size_t i;
+	long long s, start, end;
+	int idx;
+	char host[256];
+	short *map;
+	redisReply *reply, *range, *master;
+	rai_t *rc;
+
+	rc = raip_checkout(&from->pool);
+	reply = redisCommand(rc->c, "CLUSTER SLOTS");
+	if(!reply) {
+		if(cl->err_cb) { cl->err_cb(rc); }
+		raip_checkin(&from->pool, rc);
+		return -1;
+	}
+	raip_checkin(&from->pool, rc);
+
+	if(reply->type != REDIS_REPLY_ARRAY) {
+		freeReplyObject(reply);
+		return -2;
+	}
+
+	map = malloc(RAIC_SLOTS * sizeof(short));
+	if(!map) {
+		freeReplyObject(reply);
+		return -3;
+	}
+	for(s=0; s<RAIC_SLOTS; s++) { map[s] = -1; }
+
+	for(i=0; i<reply->elements; i++) {
+		range = reply->element[i];
+		if((range->type != REDIS_REPLY_ARRAY) || (range->elements < 3)) { continue; }
+		master = range->element[2];
+		if((master->type != REDIS_REPLY_ARRAY) || (master->elements < 2)) { continue; }
+
+		start = range->element[0]->integer;
+		end = range->element[1]->integer;
+		if((start < 0) || (end >= RAIC_SLOTS) || (start > end)) { continue; }
+
+		// An empty host means "the same host you asked"
+		if(master->element[0]->len == 0) { snprintf(host, sizeof(host), "%s", from->host); }
+		else { snprintf(host, sizeof(host), "%s", master->element[0]->str); }
+
+		idx = raic_node_get(cl, host, (unsigned short)master->element[1]->integer);
+		if(idx < 0) { continue; }
+		for(s=start; s<=end; s++) { map[s] = idx; }
+	}
+	freeReplyObject(reply);
+
+	// Slots nobody claims (or whose owner we could not reach) keep their last known owner
+	pthread_rwlock_wrlock(&cl->cl);
+	for(s=0; s<RAIC_SLOTS; s++) {
+		if(map[s] >= 0) { cl->slots[s] = map[s]; }
+	}
+	pthread_rwlock_unlock(&cl->cl);
+
+	free(map);
+	return 0;
+}
+
+// Reload the slot map from one node, or from any node but skip after a connection error
+// A reload after a connection error is rate limited, concurrent failures share one reload
+// return 0 if a new slot map was applied
+static int raic_refresh(raic_t *cl, raic_node_t *from, raic_node_t *skip)
+{
+	int i, count, z = -1;
+	long long now;
+
+	pthread_mutex_lock(&cl->rl);
+
+	if(from) { z = raic_load_slots(cl, from); }
+	else {
+		now = rai_now_ms();
+		if(now - cl->refreshed_at < RAIC_REFRESH_MS) {
+			pthread_mutex_unlock(&cl->rl);
+			return 1;
+		}
+		cl->refreshed_at = now;
+
+		pthread_rwlock_rdlock(&cl->cl);
+		count = cl->nodecount;
+		pthread_rwlock_unlock(&cl->cl);
+
+		// A failed over master is no longer in charge of its slots, ask the rest of the cluster
+		for(i=0; i<count; i++) {
+			if(cl->nodes[i] == skip) { continue; }
+			z = raic_load_slots(cl, cl->nodes[i]);
+			if(z == 0) { break; }
+		}
+	}
+
+	pthread_mutex_unlock(&cl->rl);
+	return z;
+}
+
+// return 0 on success
+// return -1 means we could not connect to the seed node
+// return -2 means the seed node did not give us a slot map
+// return -3 means pthread_rwlock_init() or pthread_mutex_init() failed
+int raic_connect(raic_t *cl, char *host, unsigned short port, int poolsize, void *err_cb)
+{
+	int i, seed;
+
+	memset(cl, 0, sizeof(raic_t));
+	for(i=0; i<RAIC_SLOTS; i++) { cl->slots[i] = -1; }
+	cl->poolsize = poolsize;
+	cl->err_cb = err_cb;
+	if(pthread_rwlock_init(&cl->cl, NULL)) { return -3; }
+	if(pthread_mutex_init(&cl->rl, NULL)) { return -3; }
+
+	seed = raic_node_get(cl, host, port);
+	if(seed < 0) { return -1; }
+	if(raic_refresh(cl, cl->nodes[seed], NULL)) { return -2; }
+
+	return 0;
+}
+
+// The node that owns slot right now
+static raic_node_t* raic_slot_node(raic_t *cl, unsigned int slot)
+{
+	int idx;
+	raic_node_t *n;
+
+	pthread_rwlock_rdlock(&cl->cl);
+	idx = cl->slots[slot];
+	if(idx < 0) { idx = 0; }	// Nobody claims this slot, let a node redirect us
+	n = cl->nodes[idx];
+	pthread_rwlock_unlock(&cl->cl);
+
+	return n;
+}
+
+// Parse "MOVED <slot> <host>:<port>" or "ASK <slot> <host>:<port>"
+// return 0 on success
+static int parse_redirect(const char *err, const char *fallback_host, char *host, size_t hostlen, unsigned short *port)
+{
+	const char *addr, *colon;
+
+	addr = strchr(err, ' ');
+	if(!addr) { return 1; }
+	addr = strchr(addr+1, ' ');
+	if(!addr) { return 2; }
+	addr++;
+
+	colon = strrchr(addr, ':');
+	if(!colon) { return 3; }
+	*port = atoi(colon+1);
+
+	if(colon == addr) { snprintf(host, hostlen, "%s", fallback_host); }
+	else { snprintf(host, hostlen, "%.*s", (int)(colon-addr), addr); }
+
+	return 0;
+}
+
+// Run a command on the master that owns key, following MOVED/ASK redirections
+// A connection error reloads the slot map from the rest of the cluster and retries once on the new owner
+// return NULL on a redis error (err_cb has already been called)
+redisReply* raic_command_argv(raic_t *cl, const char *key, int argc, const char **argv, const size_t *argvlen)
+{
+	int i, idx;
+	int asking = 0;
+	int retried = 0;
+	unsigned int slot;
+	unsigned short port;
+	char host[256];
+	raic_node_t *n, *failed;
+	redisReply *reply, *r;
+	rai_t *rc;
+
+	slot = raic_keyslot(key, strlen(key));
+	n = raic_slot_node(cl, slot);
+
+	for(i=0; i<=RAIC_MAX_REDIRECTS; i++) {
+		rc = raip_checkout(&n->pool);
+		if(asking) {
+			r = redisCommand(rc->c, "ASKING");
+			if(r) { freeReplyObject(r); }
+		}
+		reply = redisCommandArgv(rc->c, argc, argv, argvlen);
+		if(!reply) {
+			if(cl->err_cb) { cl->err_cb(rc); }
+			raip_checkin(&n->pool, rc);
+
+			// The master may have failed over, nobody would ever send us a MOVED for it
+			if(retried || asking) { return NULL; }
+			retried = 1;
+			if(raic_refresh(cl, NULL, n)) { return NULL; }
+			failed = n;
+			n = raic_slot_node(cl, slot);
+			if(n == failed) { return NULL; }
+			continue;
+		}
+		raip_checkin(&n->pool, rc);
+
+		if(reply->type != REDIS_REPLY_ERROR) { return reply; }
+
+		if(strncmp(reply->str, "MOVED ", 6) == 0) {
+			if(parse_redirect(reply->str, n->host, host, sizeof(host), &port)) { return reply; }
+			freeReplyObject(reply);
+			asking = 0;
+
+			// The slot map has changed, reload it from the new owner
+			idx = raic_node_get(cl, host, port);
+			if(idx < 0) { return NULL; }
+			pthread_rwlock_wrlock(&cl->cl);
+			cl->slots[slot] = idx;
+			pthread_rwlock_unlock(&cl->cl);
+			raic_refresh(cl, cl->nodes[idx], NULL);
+			n = raic_slot_node(cl, slot);
+		} else if(strncmp(reply->str, "ASK ", 4) == 0) {
+			if(parse_redirect(reply->str, n->host, host, sizeof(host), &port)) { return reply; }
+			freeReplyObject(reply);
+			asking = 1;
+
+			// The slot is migrating, only this command goes to the new owner
+			idx = raic_node_get(cl, host, port);
+			if(idx < 0) { return NULL; }
+			n = cl->nodes[idx];
+		} else {
+			return reply;
+		}
+	}
+
+	return NULL;	// Too many redirections
+}
+
+// The index of the master that owns key right now
+// Keys of different slots can share a master, and so a pipeline
+int raic_key_node(raic_t *cl, const char *key)
+{
+	int idx;
+
+	pthread_rwlock_rdlock(&cl->cl);
+	idx = cl->slots[raic_keyslot(key, strlen(key))];
+	pthread_rwlock_unlock(&cl->cl);
+
+	return (idx < 0) ? 0 : idx;
+}
+
+static inline int is_redirect(redisReply *reply)
+{
+	if(reply->type != REDIS_REPLY_ERROR) { return 0; }
+	return ((strncmp(reply->str, "MOVED ", 6) == 0) || (strncmp(reply->str, "ASK ", 4) == 0));
+}
+
+// Pipeline count commands to the master that owns keys[0], in one round trip
+// Every key should live on that master (see raic_key_node()), keys[i] is the key of command i
+// A command that is redirected (the slot moved) or left without a reply is sent again on its own
+// with raic_command_argv(), which follows MOVED/ASK and fail overs
+// replies[i] is NULL on a redis error (err_cb has already been called)
+void raic_pipeline_argv(raic_t *cl, int count, const char **keys, const int *argc, const char ***argv, const size_t **argvlen, redisReply **replies)
+{
+	int i, sent = 0;
+	raic_node_t *n;
+	rai_t *rc;
+
+	for(i=0; i<count; i++) { replies[i] = NULL; }
+	if(count < 1) { return; }
+
+	n = raic_slot_node(cl, raic_keyslot(keys[0], strlen(keys[0])));
+	rc = raip_checkout(&n->pool);
+	for(i=0; i<count; i++) {
+		if(redisAppendCommandArgv(rc->c, argc[i], argv[i], argvlen[i]) != REDIS_OK) { break; }
+		sent++;
+	}
+	for(i=0; i<sent; i++) {
+		if(redisGetReply(rc->c, (void **)&replies[i]) != REDIS_OK) {
+			replies[i] = NULL;
+			break;
+		}
+	}
+	if(rc->c->err && cl->err_cb) { cl->err_cb(rc); }
+	raip_checkin(&n->pool, rc);
+
+	for(i=0; i<count; i++) {
+		if(replies[i] && !is_redirect(replies[i])) { continue; }
+		if(replies[i]) { freeReplyObject(replies[i]); }
+		replies[i] = raic_command_argv(cl, keys[i], argc[i], argv[i], argvlen[i]);
+	}
+}
+
+// Run a keyless command (e.g. SCRIPT LOAD) on every master
+// return the reply from the last node, NULL if any node failed
+redisReply* raic_command_all(raic_t *cl, int argc, const char **argv, const size_t *argvlen)
+{
+	int i, count;
+	raic_node_t *n;
+	redisReply *reply = NULL;
+	rai_t *rc;
+
+	pthread_rwlock_rdlock(&cl->cl);
+	count = cl->nodecount;
+	pthread_rwlock_unlock(&cl->cl);
+
+	for(i=0; i<count; i++) {
+		if(reply) { freeReplyObject(reply); }
+		n = cl->nodes[i];
+		rc = raip_checkout(&n->pool);
+		reply = redisCommandArgv(rc->c, argc, argv, argvlen);
+		if(!reply && cl->err_cb) { cl->err_cb(rc); }
+		raip_checkin(&n->pool, rc);
+		if(!reply) { return NULL; }
+	}
+
+	return reply;
+}
+
+// Apply a command timeout to every node, including the ones we find later
+void raic_set_timeout(raic_t *cl, long ms)
+{
+	int i;
+
+	pthread_rwlock_wrlock(&cl->cl);
+	cl->timeout = ms;
+	for(i=0; i<cl->nodecount; i++) { raip_set_timeout(&cl->nodes[i]->pool, ms); }
+	pthread_rwlock_unlock(&cl->cl);
+}
+
+void raic_disconnect(raic_t *cl)
+{
+	int i;
+	raic_node_t *n;
+
+	pthread_rwlock_wrlock(&cl->cl);
+	for(i=0; i<cl->nodecount; i++) {
+		n = cl->nodes[i];
+		raip_disconnect(&n->pool);
+		free(n->host);
+		free(n);
+		cl->nodes[i] = NULL;
+	}
+	cl->nodecount = 0;
+	pthread_rwlock_unlock(&cl->cl);
+}
@@ -0,0 +1,60 @@
+/*
+	Copyright (C) 2021 Brett Kuskie <fullaxx@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; version 2 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __REDIS_ADVANCED_INTERFACE_CLUSTER_H__
+#define __REDIS_ADVANCED_INTERFACE_CLUSTER_H__
+
+#include "rai.h"
+
+#define RAIC_SLOTS			(16384)
+#define RAIC_MAX_NODES		(128)
+#define RAIC_MAX_REDIRECTS	(5)
+#define RAIC_REFRESH_MS		(1000)	// Slot map reloads after a connection error, at most one per period
+
+#define RAIC_ERROR_CALLBACK(CB)	void (CB)(rai_t *);
+
+// One cluster master, with its own pool of contexts
+typedef struct {
+	char *host;
+	unsigned short port;
+	raip_t pool;
+} raic_node_t;
+
+// Nodes are never removed while we are running, so node pointers stay valid
+// The lock only guards the node list and the slot map, nobody talks to redis while holding it
+typedef struct {
+	pthread_rwlock_t cl;
+	pthread_mutex_t rl;			// one slot map reload at a time
+	long long refreshed_at;		// ms, the last reload after a connection error
+	raic_node_t *nodes[RAIC_MAX_NODES];
+	int nodecount;
+	short slots[RAIC_SLOTS];
+	int poolsize;
+	long timeout;
+	RAIC_ERROR_CALLBACK(*err_cb);
+} raic_t;
+
+unsigned int raic_keyslot(const char *key, size_t keylen);
+int raic_connect(raic_t *cl, char *host, unsigned short port, int poolsize, void *err_cb);
+redisReply* raic_command_argv(raic_t *cl, const char *key, int argc, const char **argv, const size_t *argvlen);
+redisReply* raic_command_all(raic_t *cl, int argc, const char **argv, const size_t *argvlen);
+int raic_key_node(raic_t *cl, const char *key);
+void raic_pipeline_argv(raic_t *cl, int count, const char **keys, const int *argc, const char ***argv, const size_t **argvlen, redisReply **replies);
+void raic_set_timeout(raic_t *cl, long ms);
+void raic_disconnect(raic_t *cl);
+
+#endif
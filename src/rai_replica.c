@@ -0,0 +1,82 @@
+/*
+	Copyright (C) 2021 Brett Kuskie <fullaxx@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; version 2 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rai_replica.h"
+
+// return 0 on success
+// return -1 if there are too many replicas
+// any other error is passed along from raip_connect()
+int rair_add(rair_t *r, char *dest, unsigned short port, int poolsize)
+{
+	int z;
+
+	if(r->count >= RAIR_MAX_REPLICAS) { return -1; }
+	z = raip_connect(&r->pools[r->count], poolsize, dest, port);
+	if(z) { return z; }
+	r->outstanding[r->count] = 0;
+	r->count++;
+
+	return 0;
+}
+
+static inline int pick_least_outstanding(rair_t *r)
+{
+	int i, n, v, start, best, min;
+
+	// Start somewhere different every time, so that ties are spread out
+	start = best = __sync_fetch_and_add(&r->next, 1) % r->count;
+	min = __atomic_load_n(&r->outstanding[best], __ATOMIC_RELAXED);
+	for(i=1; i<r->count; i++) {
+		n = (start + i) % r->count;
+		v = __atomic_load_n(&r->outstanding[n], __ATOMIC_RELAXED);
+		if(v < min) { best = n; min = v; }
+	}
+
+	return best;
+}
+
+// Pick a replica according to our policy and checkout one of its contexts
+// this must be returned with rair_checkin()
+rai_t* rair_checkout(rair_t *r, int *replica)
+{
+	int n;
+
+	if(r->policy == RAIR_LEAST_OUTSTANDING) { n = pick_least_outstanding(r); }
+	else { n = __sync_fetch_and_add(&r->next, 1) % r->count; }
+
+	__sync_fetch_and_add(&r->outstanding[n], 1);
+	*replica = n;
+	return raip_checkout(&r->pools[n]);
+}
+
+void rair_checkin(rair_t *r, int replica, rai_t *rc)
+{
+	raip_checkin(&r->pools[replica], rc);
+	__sync_fetch_and_sub(&r->outstanding[replica], 1);
+}
+
+void rair_disconnect(rair_t *r)
+{
+	int i;
+
+	for(i=0; i<r->count; i++) { raip_disconnect(&r->pools[i]); }
+	r->count = 0;
+}
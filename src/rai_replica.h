@@ -0,0 +1,42 @@
+/*
+	Copyright (C) 2021 Brett Kuskie <fullaxx@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; version 2 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __REDIS_ADVANCED_INTERFACE_REPLICA_H__
+#define __REDIS_ADVANCED_INTERFACE_REPLICA_H__
+
+#include "rai.h"
+
+#define RAIR_MAX_REPLICAS		(16)
+
+#define RAIR_ROUND_ROBIN		(0)
+#define RAIR_LEAST_OUTSTANDING	(1)
+
+// A set of read replicas, each with its own pool of contexts
+typedef struct {
+	raip_t pools[RAIR_MAX_REPLICAS];
+	int outstanding[RAIR_MAX_REPLICAS];
+	int count;
+	int policy;
+	unsigned int next;
+} rair_t;
+
+int rair_add(rair_t *r, char *dest, unsigned short port, int poolsize);
+rai_t* rair_checkout(rair_t *r, int *replica);
+void rair_checkin(rair_t *r, int replica, rai_t *rc);
+void rair_disconnect(rair_t *r);
+
+#endif
@@ -0,0 +1,154 @@
+/*
+	Copyright (C) 2021 Brett Kuskie <fullaxx@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; version 2 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// Every shard owns RAIS_VNODES points on a 32 bit ring, placed by hashing its address
+// A key belongs to the first point at or after its own hash
+// Adding a shard only takes over the keys that land just before its points (~1/N)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rai_shard.h"
+
+// FNV-1a
+static uint32_t fnv1a(const char *buf, size_t len)
+{
+	size_t i;
+	uint32_t h = 2166136261U;
+
+	for(i=0; i<len; i++) {
+		h ^= (unsigned char)buf[i];
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+static inline int hexval(char c)
+{
+	if((c >= '0') && (c <= '9')) { return c - '0'; }
+	if((c >= 'a') && (c <= 'f')) { return c - 'a' + 10; }
+	return -1;
+}
+
+// Tokens are already uniformly distributed lowercase hex, so their first 32 bits are used as is
+// A token in a hash tag ({<token>}:...) lands with the token, so a RENAME stays on one shard
+// Everything else (e.g. IPS:<ip>) is hashed with FNV-1a
+static uint32_t key_point(const char *key)
+{
+	int i, v;
+	uint32_t h = 0;
+
+	if(key[0] == '{') { key++; }
+	for(i=0; i<8; i++) {
+		v = hexval(key[i]);
+		if(v < 0) { return fnv1a(key, strlen(key)); }
+		h = (h << 4) | v;
+	}
+
+	return h;
+}
+
+static int vnode_cmp(const void *a, const void *b)
+{
+	const rais_vnode_t *x = a;
+	const rais_vnode_t *y = b;
+
+	if(x->point < y->point) { return -1; }
+	if(x->point > y->point) { return 1; }
+	return (x->shard - y->shard);
+}
+
+// return 0 on success
+// return -1 if there are too many shards
+// return -2 if we could not connect
+int rais_add(rais_t *s, char *dest, unsigned short port, int poolsize)
+{
+	char name[512];
+
+	if(s->count >= RAIS_MAX_SHARDS) { return -1; }
+	if(raip_connect(&s->pools[s->count], poolsize, dest, port)) { return -2; }
+
+	if(port) { snprintf(name, sizeof(name), "%s:%u", dest, port); }
+	else { snprintf(name, sizeof(name), "%s", dest); }
+	s->names[s->count] = strdup(name);
+	s->count++;
+
+	return 0;
+}
+
+// Build the ring once all shards have been added
+// return 0 on success
+int rais_build(rais_t *s)
+{
+	int i, v, n = 0;
+	char label[544];
+
+	if(s->count < 1) { return -1; }
+
+	s->ring = calloc(s->count * RAIS_VNODES, sizeof(rais_vnode_t));
+	if(!s->ring) { return -2; }
+
+	for(i=0; i<s->count; i++) {
+		for(v=0; v<RAIS_VNODES; v++) {
+			snprintf(label, sizeof(label), "%s#%d", s->names[i], v);
+			s->ring[n].point = fnv1a(label, strlen(label));
+			s->ring[n].shard = i;
+			n++;
+		}
+	}
+
+	qsort(s->ring, n, sizeof(rais_vnode_t), &vnode_cmp);
+	s->ringsize = n;
+
+	return 0;
+}
+
+// return the pool of the shard that owns key
+raip_t* rais_pick(rais_t *s, const char *key)
+{
+	int lo, hi, mid;
+	uint32_t h;
+
+	h = key_point(key);
+
+	lo = 0;
+	hi = s->ringsize;
+	while(lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if(s->ring[mid].point < h) { lo = mid + 1; }
+		else { hi = mid; }
+	}
+	if(lo == s->ringsize) { lo = 0; }
+
+	return &s->pools[s->ring[lo].shard];
+}
+
+void rais_disconnect(rais_t *s)
+{
+	int i;
+
+	for(i=0; i<s->count; i++) {
+		raip_disconnect(&s->pools[i]);
+		free(s->names[i]);
+	}
+	if(s->ring) { free(s->ring); }
+	s->ring = NULL;
+	s->ringsize = 0;
+	s->count = 0;
+}
@@ -0,0 +1,47 @@
+/*
+	Copyright (C) 2021 Brett Kuskie <fullaxx@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; version 2 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __REDIS_ADVANCED_INTERFACE_SHARD_H__
+#define __REDIS_ADVANCED_INTERFACE_SHARD_H__
+
+#include <stdint.h>
+
+#include "rai.h"
+
+#define RAIS_MAX_SHARDS	(64)
+#define RAIS_VNODES		(160)
+
+typedef struct {
+	uint32_t point;
+	int shard;
+} rais_vnode_t;
+
+// Independent redis instances, keys are placed on a consistent hash ring
+typedef struct {
+	raip_t pools[RAIS_MAX_SHARDS];
+	char *names[RAIS_MAX_SHARDS];
+	int count;
+	rais_vnode_t *ring;
+	int ringsize;
+} rais_t;
+
+int rais_add(rais_t *s, char *dest, unsigned short port, int poolsize);
+int rais_build(rais_t *s);
+raip_t* rais_pick(rais_t *s, const char *key);
+void rais_disconnect(rais_t *s);
+
+#endif
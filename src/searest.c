@@ -23,11 +23,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <arpa/inet.h>
 
 #include <sys/types.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 
 #include "searest.h"
 
@@ -42,6 +47,63 @@ int searest_node_is_disabled(srn_t *n);
 void searest_node_destroy_all(sri_t *ws);
 srn_t* searest_node_find(sri_t *ws, char *rootname);
 
+void* srbp_get(size_t len, size_t *cap);
+void srbp_put(void *p);
+
+#ifdef SEARESTURING
+void* sru_start(sri_t *ws, int listen_fd, void *sri_user_data);
+void sru_stop(void *engine);
+#endif
+
+// Everything we keep for the life of a connection
+// The request info and its strings are reused by every request on a keep-alive connection
+typedef struct {
+	srci_t ri;
+	sra_t arena;
+	char ip[INET6_ADDRSTRLEN];
+} srcc_t;
+
+static void* sra_alloc(sra_t *a, size_t len)
+{
+	size_t off;
+	void **blk;
+
+	off = (a->used + 7) & ~((size_t)7);
+	if(off + len <= SR_ARENA_SIZE) {
+		a->used = off + len;
+		return &a->buf[off];
+	}
+
+	blk = malloc(sizeof(void *) + len);
+	if(!blk) { return NULL; }
+	blk[0] = a->spill;
+	a->spill = blk;
+	return &blk[1];
+}
+
+static char* sra_strdup(sra_t *a, const char *s)
+{
+	size_t len = strlen(s) + 1;
+	char *d = sra_alloc(a, len);
+	if(d) { memcpy(d, s, len); }
+	return d;
+}
+
+static void sra_reset(sra_t *a)
+{
+	void **blk, **next;
+
+	for(blk=a->spill; blk; blk=next) {
+		next = blk[0];
+		free(blk);
+	}
+	a->spill = NULL;
+	a->used = 0;
+}
+
+// Serializes the hand-off between a suspending request and its resumer
+static pthread_mutex_t g_suspend_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 char* srci_get_client_ip(srci_t *ri)
 {
 	return ri->ip;
@@ -52,6 +114,12 @@ char* srci_get_browser_auth(srci_t *ri)
 	return ri->auth;
 }
 
+// The Range header, NULL if the client did not send one
+char* srci_get_range(srci_t *ri)
+{
+	return ri->range;
+}
+
 int srci_browser_requests_text(srci_t *ri)
 {
 	if(!ri->accept) { return 0; }
@@ -80,14 +148,12 @@ int srci_get_method_type(srci_t *ri)
 
 void srci_set_response_content_type(srci_t *ri, char *ct)
 {
-	if(ri->content_type) { free(ri->content_type); }
-	ri->content_type = strdup(ct);
+	ri->content_type = sra_strdup(ri->arena, ct);
 }
 
 void srci_set_response_allow(srci_t *ri, char *a)
 {
-	if(ri->allow) { free(ri->allow); }
-	ri->allow = strdup(a);
+	ri->allow = sra_strdup(ri->arena, a);
 }
 
 void srci_set_response_cors(srci_t *ri)
@@ -97,52 +163,176 @@ void srci_set_response_cors(srci_t *ri)
 	ri->cors = 1;
 }
 
+// The name and value are copied
+// return 0 on success
+int srci_add_response_header(srci_t *ri, const char *name, const char *value)
+{
+	char *n, *v;
+
+	if(ri->hdr_count == SR_MAX_RESPONSE_HEADERS) { return 1; }
+	n = sra_strdup(ri->arena, name);
+	v = sra_strdup(ri->arena, value);
+	if(!n || !v) { return 1; }
+
+	ri->hdr_names[ri->hdr_count] = n;
+	ri->hdr_values[ri->hdr_count] = v;
+	ri->hdr_count++;
+	return 0;
+}
+
+// Answer a HEAD request for a body of len bytes, without having the body
+// Content-Length announces len, the page returned by the node callback is never sent
+void srci_set_head_length(srci_t *ri, size_t len)
+{
+	ri->head_length = len;
+	ri->head_length_set = 1;
+}
+
 const unsigned char* srci_get_post_data_ptr(srci_t *ri)
 {
 	return ri->post_data;
 }
 
+// The number of bytes uploaded, even if an upload callback consumed them
 size_t srci_get_post_data_size(srci_t *ri)
 {
 	return ri->post_data_len;
 }
 
+// 0, or the HTTP status an upload callback rejected the body with
+int srci_get_upload_status(srci_t *ri)
+{
+	return ri->upload_status;
+}
+
+// Memory that lasts until the request is complete, it must not be free()'d
+void* srci_alloc(srci_t *ri, size_t len)
+{
+	return sra_alloc(ri->arena, len);
+}
+
+void srci_set_node_data(srci_t *ri, void *data)
+{
+	ri->node_data = data;
+}
+
+void* srci_get_node_data(srci_t *ri)
+{
+	return ri->node_data;
+}
+
 void srci_set_return_code(srci_t *ri, int code)
 {
 	ri->return_code = code;
 }
 
-// THIS MUST BE FREE()'d -- and it does get free()'d in uhd_request_completed()
-static char* client_ip_str (struct MHD_Connection *connection)
+// Hand a response body to searest without copying it, instead of returning a page
+// The node callback must then return NULL
+// data must stay valid until free_cb(cls) is called from uhd_request_completed()
+void srci_set_return_data(srci_t *ri, const void *data, size_t len, void *free_cb, void *cls)
 {
-	const union MHD_ConnectionInfo *ci;
-	struct sockaddr_in *in;
-	char ip_str[128];
+	ri->return_data = data;
+	ri->return_data_len = len;
+	ri->return_data_free = free_cb;
+	ri->return_data_cls = cls;
+}
 
-	ci = MHD_get_connection_info (connection, MHD_CONNECTION_INFO_CLIENT_ADDRESS);
-	if(!ci) { return NULL; }
+// Hand searest a response body of size bytes that is produced as the client drains it, instead of returning a page
+// The node callback must then return NULL
+// reader(cls, pos, buf, max) copies up to max bytes from pos into buf and returns how many it copied
+// or MHD_CONTENT_READER_END_WITH_ERROR to drop the connection
+// free_cb(cls) is called once the response is done with
+void srci_set_return_reader(srci_t *ri, uint64_t size, size_t block, void *reader, void *free_cb, void *cls)
+{
+	ri->reader_size = size;
+	ri->reader_block = block;
+	ri->reader = reader;
+	ri->reader_free = free_cb;
+	ri->reader_cls = cls;
+}
+
+// A node callback calls this (and then returns NULL) to defer its response
+// The connection will be suspended until srci_resume() is called
+// Requires searest_set_suspend_resume()
+void srci_suspend(srci_t *ri)
+{
+	pthread_mutex_lock(&g_suspend_mutex);
+	ri->pending = 1;
+	pthread_mutex_unlock(&g_suspend_mutex);
+}
 
-	in = (struct sockaddr_in *)ci->client_addr;
-	if(!in) { return NULL; }
+// Deliver the deferred response page from any thread
+// page must be malloc()'d, it gets free()'d in uhd_request_completed()
+void srci_resume(srci_t *ri, char *page)
+{
+	pthread_mutex_lock(&g_suspend_mutex);
+	ri->return_page = page;
+	ri->pending = 0;
+	if(ri->suspended) { MHD_resume_connection(ri->connection); }
+	pthread_mutex_unlock(&g_suspend_mutex);
+}
 
-	switch(in->sin_family) {
+// A unix socket peer has no address, it is reported as "unix"
+// return 0 on success
+int searest_sockaddr_str (const struct sockaddr *sa, char *ip_str, size_t len)
+{
+	switch(sa->sa_family) {
 		case AF_INET:
-			inet_ntop(AF_INET, &in->sin_addr, &ip_str[0], INET_ADDRSTRLEN);
+			if(!inet_ntop(AF_INET, &((const struct sockaddr_in *)sa)->sin_addr, ip_str, len)) { return 1; }
 			break;
 		case AF_INET6:
-			inet_ntop(AF_INET6, &in->sin_addr, &ip_str[0], INET6_ADDRSTRLEN);
+			if(!inet_ntop(AF_INET6, &((const struct sockaddr_in6 *)sa)->sin6_addr, ip_str, len)) { return 1; }
+			break;
+		case AF_UNIX:
+			snprintf(ip_str, len, "unix");
 			break;
 		default:
-			return NULL;
+			return 2;
 	}
 
-	return strdup(ip_str);
+	return 0;
+}
+
+// Called once per connection, the result is kept in the connection context
+static int client_ip_str (struct MHD_Connection *connection, char *ip_str, size_t len)
+{
+	const union MHD_ConnectionInfo *ci;
+
+	ci = MHD_get_connection_info (connection, MHD_CONNECTION_INFO_CLIENT_ADDRESS);
+	if(!ci) { return 1; }
+	if(!ci->client_addr) { return 2; }
+
+	if(searest_sockaddr_str(ci->client_addr, ip_str, len)) { return 3; }
+
+	return 0;
 }
 
-static char* process_request(sri_t *ws, srci_t *ri, void *sri_user_data)
+// Allocate our connection context when a connection starts, free it when it closes
+static void uhd_connection_notify (void *user_data, struct MHD_Connection *connection, void **socket_context, enum MHD_ConnectionNotificationCode toe)
+{
+	srcc_t *cc;
+
+	if(toe == MHD_CONNECTION_NOTIFY_STARTED) {
+		cc = malloc(sizeof(srcc_t));
+		if(!cc) { return; }
+		cc->arena.used = 0;
+		cc->arena.spill = NULL;
+		if(client_ip_str(connection, cc->ip, sizeof(cc->ip))) { cc->ip[0] = 0; }
+		*socket_context = cc;
+	} else if(toe == MHD_CONNECTION_NOTIFY_CLOSED) {
+		cc = *socket_context;
+		if(!cc) { return; }
+		sra_reset(&cc->arena);
+		free(cc);
+		*socket_context = NULL;
+	}
+}
+
+char* searest_request_process(sri_t *ws, srci_t *ri, void *sri_user_data)
 {
 	srn_t *n;
 	size_t nlen;
+	char *page;
 #ifdef SRNODECHRONOMETRY
 	stopwatch_t sw;
 #endif
@@ -150,23 +340,207 @@ static char* process_request(sri_t *ws, srci_t *ri, void *sri_user_data)
 	n = searest_node_find(ws, ri->url);
 	if(!n) {
 		ri->return_code = MHD_HTTP_NOT_FOUND;
-		ri->return_page = strdup("node not found");
+		page = ri->return_page = strdup("node not found");
 	} else if(searest_node_is_disabled(n)){
 		ri->return_code = MHD_HTTP_SERVICE_UNAVAILABLE;
-		ri->return_page = strdup("node not enabled");
+		page = ri->return_page = strdup("node not enabled");
 	} else {
 		nlen = searest_node_len(n);
 #ifdef SRNODECHRONOMETRY
 		chron_start(&sw, -1);
 #endif
-		ri->return_page = n->cb(ri->url+nlen, ri->urllen-nlen, ri, sri_user_data, n->nud);
+		page = n->cb(ri->url+nlen, ri->urllen-nlen, ri, sri_user_data, n->nud);
 #ifdef SRNODECHRONOMETRY
 		searest_node_save_time(n, chron_stop(&sw));
 #endif
 		searest_node_set_access(n);
+
+		// A deferred response is delivered to ri->return_page by srci_resume()
+		if(page) { ri->return_page = page; }
+	}
+
+	return page;
+}
+
+// Make room for len bytes of upload data
+// return 0 on success
+static int post_data_reserve(srci_t *ri, size_t len)
+{
+	size_t cap;
+	unsigned char *p;
+
+	if(ri->post_data && (len <= ri->post_data_cap)) { return 0; }
+	if(len < ri->post_data_cap*2) { len = ri->post_data_cap*2; }
+
+	p = srbp_get(len, &cap);
+	if(!p) { return 1; }
+	if(ri->post_data) {
+		memcpy(p, ri->post_data, ri->post_data_len);
+		srbp_put(ri->post_data);
+	}
+	ri->post_data = p;
+	ri->post_data_cap = cap;
+
+	return 0;
+}
+
+// Hand one upload chunk to the node's upload callback
+static int upload_chunk(sri_t *ws, srci_t *ri, const char *data, size_t len)
+{
+	srn_t *n = ri->upload_node;
+	size_t nlen = searest_node_len(n);
+
+	return n->upload_cb(ri->url+nlen, ri->urllen-nlen, ri, data, len, ws->sri_user_data, n->nud);
+}
+
+// Look at a request before its body is transferred
+// return a page to answer it now, in place of 100 Continue
+// return NULL to carry on with the upload
+// A node precheck callback must set the return code of any page it returns
+char* searest_request_precheck(sri_t *ws, srci_t *ri, void *sri_user_data)
+{
+	srn_t *n;
+	size_t nlen;
+	char *page;
+
+	if(ri->content_length > ws->max_content_length) {
+		ri->return_code = MHD_HTTP_PAYLOAD_TOO_LARGE;
+		return (ri->return_page = strdup("payload too large"));
+	}
+
+	// A body for a node that will never take it is refused before it is sent
+	// Without a body, searest_request_process() gives the same answer and the connection is kept
+	n = searest_node_find(ws, ri->url);
+	if((!n || searest_node_is_disabled(n)) && (ri->content_length || ri->chunked)) {
+		ri->return_code = n ? MHD_HTTP_SERVICE_UNAVAILABLE : MHD_HTTP_NOT_FOUND;
+		return (ri->return_page = strdup(n ? "node not enabled" : "node not found"));
+	}
+	if(!n || !n->precheck_cb || searest_node_is_disabled(n)) { return NULL; }
+
+	nlen = searest_node_len(n);
+	page = n->precheck_cb(ri->url+nlen, ri->urllen-nlen, ri, sri_user_data, n->nud);
+	if(page) { ri->return_page = page; }
+
+	return page;
+}
+
+// Fill in a new request from its request line and headers, every engine starts a request this way
+// The header values may be NULL
+// return 0 on success, the connection should be dropped otherwise
+int searest_request_init(sri_t *ws, srci_t *ri, sra_t *arena, const char *url, const char *method,
+const char *accept, const char *auth, const char *content_length, const char *te, const char *range)
+{
+	memset(ri, 0, sizeof(srci_t));
+	ri->arena = arena;
+
+	ri->urllen = strlen(url);
+	if(ri->urllen < ws->min_url_len) { return 1; }
+	if(ri->urllen > ws->max_url_len) { return 1; }
+	if(strlen(method) < 3) { return 1; }
+	if(strlen(method) > 7) { return 1; }
+
+	ri->url = sra_strdup(ri->arena, url);
+	if(!ri->url) { return 1; }
+
+	if(accept) { ri->accept = sra_strdup(ri->arena, accept); }
+	if(auth) { ri->auth = sra_strdup(ri->arena, auth); }
+	if(range) { ri->range = sra_strdup(ri->arena, range); }
+	if(content_length) { ri->content_length = atol(content_length); }
+	if(te && strstr(te, "chunked")) { ri->chunked = 1; }
+
+	// Process Method
+	if (strcmp (method, "GET") == 0)			{ ri->method_type = METHOD_GET; }
+	else if (strcmp (method, "POST") == 0)		{ ri->method_type = METHOD_POST; }
+	else if (strcmp (method, "PUT") == 0)		{ ri->method_type = METHOD_PUT; }
+	else if (strcmp (method, "DELETE") == 0)	{ ri->method_type = METHOD_DEL; }
+	else if (strcmp (method, "OPTIONS") == 0)	{ ri->method_type = METHOD_OPT; }
+	else if (strcmp (method, "HEAD") == 0)		{ ri->method_type = METHOD_HEAD; }
+	else { return 1; }
+
+	return 0;
+}
+
+// Gather one piece of the request body, for every engine
+// return 0 on success, the connection should be dropped otherwise
+int searest_request_upload(sri_t *ws, srci_t *ri, const char *data, size_t len)
+{
+	int z;
+	size_t newbufsize = ri->post_data_len + len;
+
+	// A chunked body has no Content-Length, only our own limit
+	if(ri->chunked) { if(newbufsize > ws->max_content_length) { return 1; } }
+	else if(newbufsize > ri->content_length) { return 1; }
+
+	// A rejected body is drained, the node callback answers once it is complete
+	if(ri->upload_status) { ri->post_data_len = newbufsize; return 0; }
+
+	if(!ri->upload_node) { ri->upload_node = searest_node_find(ws, ri->url); }
+	if(ri->upload_node && ri->upload_node->upload_cb && !searest_node_is_disabled(ri->upload_node)) {
+		z = upload_chunk(ws, ri, data, len);
+		if(z != SR_UPLOAD_BUFFER) {
+			if(z != SR_UPLOAD_CONSUMED) { ri->upload_status = z; }
+			ri->post_data_len = newbufsize;
+			return 0;
+		}
 	}
 
-	return ri->return_page;
+	// Content-Length tells us how big the buffer must be, a chunked body grows it
+	if(post_data_reserve(ri, ri->chunked ? newbufsize : ri->content_length)) { return 1; }
+	memcpy(ri->post_data + ri->post_data_len, data, len);
+	ri->post_data_len = newbufsize;
+	return 0;
+}
+
+// Release everything a request holds, the srci_t is reused by the next request on the connection
+void searest_request_done(srci_t *ri)
+{
+	// The strings live in the connection arena
+	if(ri->post_data) { srbp_put(ri->post_data); }
+	if(ri->return_page) { free(ri->return_page); }
+	if(ri->return_data_free) { ri->return_data_free(ri->return_data_cls); }
+	if(ri->reader_free) { ri->reader_free(ri->reader_cls); }
+	sra_reset(ri->arena);
+}
+
+// MHD never reads the body of a HEAD response
+static ssize_t head_reader(void *cls, uint64_t pos, char *buf, size_t max)
+{
+	return MHD_CONTENT_READER_END_WITH_ERROR;
+}
+
+static enum MHD_Result queue_page(struct MHD_Connection *connection, srci_t *ri, char *page)
+{
+	int i;
+	enum MHD_Result ret;
+	struct MHD_Response *response;
+
+	// What if the caller never set return code with srci_set_return_code() ?
+	// it would appear that UHD will just hang and keep the connection open ?
+	// Set return_code to OK and move on
+	if(ri->return_code == 0) { ri->return_code = MHD_HTTP_OK; }
+
+	// Both the page and the return data outlive the response
+	// They are released in uhd_request_completed(), so MHD does not need a copy
+	if(ri->head_length_set && (ri->method_type == METHOD_HEAD)) {
+		response = MHD_create_response_from_callback(ri->head_length, 1024, &head_reader, NULL, NULL);
+	} else if(ri->reader) {
+		// MHD owns the reader from here on, and frees it with the response
+		response = MHD_create_response_from_callback(ri->reader_size, ri->reader_block, ri->reader, ri->reader_cls, ri->reader_free);
+		if(response) { ri->reader_free = NULL; }
+	} else if(ri->return_data) {
+		response = MHD_create_response_from_buffer(ri->return_data_len, (void *)ri->return_data, MHD_RESPMEM_PERSISTENT);
+	} else {
+		response = MHD_create_response_from_buffer(strlen(page), page, MHD_RESPMEM_PERSISTENT);
+	}
+	if(!response) { return MHD_NO; }
+	if(ri->content_type) { MHD_add_response_header(response, HDRCTSTR, ri->content_type); }
+	if(ri->allow) { MHD_add_response_header(response, "Allow", ri->allow); }
+	if(ri->cors) { MHD_add_response_header(response, "Access-Control-Allow-Origin", "*"); }
+	for(i=0; i<ri->hdr_count; i++) { MHD_add_response_header(response, ri->hdr_names[i], ri->hdr_values[i]); }
+	ret = MHD_queue_response (connection, ri->return_code, response);
+	MHD_destroy_response (response);
+
+	return ret;
 }
 
 /* https://www.gnu.org/software/libmicrohttpd/manual/html_node/microhttpd_002dcb.html
@@ -200,55 +574,50 @@ static enum MHD_Result uhd_request_started (void *sri_user_data, struct MHD_Conn
 const char *url, const char *method, const char *version,
 const char *upload_data, size_t *upload_data_size, void **con_cls)
 {
-	int ret = MHD_NO;
+	int z, ret = MHD_NO;
 	char *page = NULL;
 	sri_t *ws = sri_user_data;
 	srci_t *ri = *con_cls;
-	struct MHD_Response *response;
+	srcc_t *cc;
+	const union MHD_ConnectionInfo *ci;
 	const char *accept_header;
 	const char *auth_header;
 	const char *content_length_header;
-
+	const char *te_header;
+	const char *range_header;
+
 	if(!url || !method || !version) { return MHD_NO; }
 
 	if (!ri) {
 #ifdef DEBUG
 		//printf ("New %s request for %s using version %s\n", method, url, version);
 #endif
-		ri = calloc (1, sizeof(srci_t));
-		if(!ri) { return MHD_NO; }
-		*con_cls = (void *)ri;
+		ci = MHD_get_connection_info (connection, MHD_CONNECTION_INFO_SOCKET_CONTEXT);
+		if(!ci || !ci->socket_context) { return MHD_NO; }
+		cc = ci->socket_context;
 
-		ri->url = strdup(url);
-		ri->urllen = strlen(url);
-		if(ri->urllen < ws->min_url_len) { return MHD_NO; }
-		if(ri->urllen > ws->max_url_len) { return MHD_NO; }
-		if(strlen(method) < 3) { return MHD_NO; }
-		if(strlen(method) > 7) { return MHD_NO; }
-
-		ri->ip = client_ip_str(connection);
+		ri = &cc->ri;
+		*con_cls = (void *)ri;
 
 		// Process Headers
 		accept_header = MHD_lookup_connection_value (connection, MHD_HEADER_KIND, HDRASTR);
-		if(accept_header) { ri->accept = strdup(accept_header); }
 		auth_header = MHD_lookup_connection_value (connection, MHD_HEADER_KIND, HDRAUTHSTR);
-		if(auth_header) { ri->auth = strdup(auth_header); }
 		content_length_header = MHD_lookup_connection_value (connection, MHD_HEADER_KIND, HDRCLSTR);
-		if(content_length_header) {
-			ri->content_length = atol(content_length_header);
-			if(ri->content_length > ws->max_content_length) { return MHD_NO; }
+		te_header = MHD_lookup_connection_value (connection, MHD_HEADER_KIND, HDRTESTR);
+		range_header = MHD_lookup_connection_value (connection, MHD_HEADER_KIND, HDRRANGESTR);
+		z = searest_request_init(ws, ri, &cc->arena, url, method,
+			accept_header, auth_header, content_length_header, te_header, range_header);
+		ri->connection = connection;
+		if(z) { return MHD_NO; }
+		if(cc->ip[0]) { ri->ip = cc->ip; }
+
+		// Ask the node if the upload is ok before the client sends it
+		page = searest_request_precheck(ws, ri, ws->sri_user_data);
+		if(page) {
+			ri->rejected = 1;
+			return queue_page(connection, ri, page);
 		}
 
-		// Process Method
-		if (strcmp (method, "GET") == 0)			{ ri->method_type = METHOD_GET; }
-		else if (strcmp (method, "POST") == 0)		{ ri->method_type = METHOD_POST; }
-		else if (strcmp (method, "PUT") == 0)		{ ri->method_type = METHOD_PUT; }
-		else if (strcmp (method, "DELETE") == 0)	{ ri->method_type = METHOD_DEL; }
-		else if (strcmp (method, "OPTIONS") == 0)	{ ri->method_type = METHOD_OPT; }
-		else { return MHD_NO; }
-
-		//We need to ask the caller if XXX bytes of upload data is ok 
-
 #ifdef DEBUG
 		//if(content_length_header) printf ("Content-Length: %s \n", content_length_header);
 #endif
@@ -256,50 +625,58 @@ const char *upload_data, size_t *upload_data_size, void **con_cls)
 		return MHD_YES;
 	}
 
+	// The response was queued in the header phase, discard any body the client sent anyway
+	if(ri->rejected) {
+		*upload_data_size = 0;
+		return MHD_YES;
+	}
+
+	// We have been resumed, the deferred response is waiting for us
+	if(ri->suspended) {
+		ri->suspended = 0;
+		if(!ri->return_page && !ri->return_data && !ri->reader) { return MHD_NO; }
+		return queue_page(connection, ri, ri->return_page);
+	}
+
 	// upload_data_size should always be a valid pointer
 	// While we have post data to gather, gather and save
 	if(upload_data && *upload_data_size) {
-		size_t blobsize = *upload_data_size;
-		size_t newbufsize = ri->post_data_len + blobsize;
-		if(newbufsize > ri->content_length) { return MHD_NO; }
-
-		ri->post_data = realloc(ri->post_data, newbufsize);
-		memcpy(ri->post_data + ri->post_data_len, upload_data, blobsize);
-		ri->post_data_len += blobsize;
+		z = searest_request_upload(ws, ri, upload_data, *upload_data_size);
 		*upload_data_size = 0;	// Tell UHD that we processed all the data it gave us
-		return MHD_YES;
+		return z ? MHD_NO : MHD_YES;
 	}
 
 	// We should only get here after post processing is done
 	// So now we check the length and make sure it matches
-	if(ri->post_data_len < ri->content_length) { return MHD_NO; }
+	if(!ri->chunked && (ri->post_data_len < ri->content_length)) { return MHD_NO; }
 
 #ifdef SEAREST_UPLOAD_DEBUG
 	if(ri->post_data) { printf ("Content: %s \n", ri->post_data); }
 #endif
 
-	page = process_request(ws, ri, ws->sri_user_data);
-
-	if(page) {
-		// What if the caller never set return code with srci_set_return_code() ?
-		// it would appear that UHD will just hang and keep the connection open ?
-		// Set return_code to OK and move on
-		if(ri->return_code == 0) { ri->return_code = MHD_HTTP_OK; }
-
-		// This will only work with text, modify this for binary file transfer
-		response = MHD_create_response_from_buffer(strlen(page), page, MHD_RESPMEM_MUST_COPY);
-		if(ri->content_type) { MHD_add_response_header(response, HDRCTSTR, ri->content_type); }
-		if(ri->allow) { MHD_add_response_header(response, "Allow", ri->allow); }
-		if(ri->cors) { MHD_add_response_header(response, "Access-Control-Allow-Origin", "*"); }
-		ret = MHD_queue_response (connection, ri->return_code, response);
-		MHD_destroy_response (response);
+	page = searest_request_process(ws, ri, ws->sri_user_data);
+
+	// The node deferred its response with srci_suspend()
+	// If the response is not ready yet, park the connection until srci_resume()
+	if(!page) {
+		pthread_mutex_lock(&g_suspend_mutex);
+		if(ri->pending) {
+			ri->suspended = 1;
+			MHD_suspend_connection(connection);
+			pthread_mutex_unlock(&g_suspend_mutex);
+			return MHD_YES;
+		}
+		page = ri->return_page;
+		pthread_mutex_unlock(&g_suspend_mutex);
 	}
 
+	if(page || ri->return_data || ri->reader) { ret = queue_page(connection, ri, page); }
+
 #ifdef DEBUG
 	//if(ret == MHD_NO)	{ fprintf (stderr, "Refusing Connection!\n"); }
 	//else				{ fprintf (stderr, "Returning %d!\n", ri->return_code); }
 #endif
-
+
 	return ret;
 }
 
@@ -308,16 +685,8 @@ static void uhd_request_completed (void *user_data, struct MHD_Connection *conne
 	srci_t *ri = *con_cls;
 	if (!ri) { return; }
 
-	if(ri->ip) { free(ri->ip); }
-	if(ri->url) { free(ri->url); }
-	if(ri->accept) { free(ri->accept); }
-	if(ri->auth) { free(ri->auth); }
-	if(ri->post_data) { free(ri->post_data); }
-	if(ri->content_type) { free(ri->content_type); }
-	if(ri->allow) { free(ri->allow); }
-	if(ri->return_page) { free(ri->return_page); }
-	free(ri);
-	*con_cls = NULL;   
+	searest_request_done(ri);
+	*con_cls = NULL;
 }
 
 /* Specify a function that should be called before parsing the URI from the client.
@@ -340,67 +709,110 @@ static void* uhd_logger (void *user_data, const char *uri)
 
 static enum MHD_Result uhd_client_connect (void *user_data, const struct sockaddr *addr, socklen_t addrlen)
 {
-	struct sockaddr_in *in = (struct sockaddr_in *)addr;
 	sri_t *ws = user_data;
-	int retval;
-	char ip_str[128];
-	char *ip;
+	char ip_str[INET6_ADDRSTRLEN];
 
 	if(!addr) { return MHD_NO; }	//this should never happen
 	if(!ws->addr_cb) { return MHD_YES; }
 
-	switch(in->sin_family) {
-		case AF_INET:
-			inet_ntop(AF_INET, &in->sin_addr, &ip_str[0], INET_ADDRSTRLEN);
-			break;
-		case AF_INET6:
-			inet_ntop(AF_INET6, &in->sin_addr, &ip_str[0], INET6_ADDRSTRLEN);
-			break;
-		default:
-			return MHD_NO;
-	}
+	// Only local processes can reach a unix socket, there is no address to check
+	if(addr->sa_family == AF_UNIX) { return MHD_YES; }
+	if(searest_sockaddr_str(addr, ip_str, sizeof(ip_str))) { return MHD_NO; }
 
 #ifdef DEBUG
 	//printf("New Connection from: %s\n", ip_str);
 #endif
 
-	ip = strdup(ip_str);
-	retval = ws->addr_cb(ip, ws->sri_user_data);
-	free(ip);
-	return retval;
+	return ws->addr_cb(ip_str, ws->sri_user_data);
+}
+
+// Fill ss from an IPv4 or IPv6 address and a port, or from a unix socket path
+// return the length of the address, 0 if it is not valid
+static socklen_t listener_addr(struct sockaddr_storage *ss, const char *addr, unsigned short port)
+{
+	struct sockaddr_in *in = (struct sockaddr_in *)ss;
+	struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)ss;
+	struct sockaddr_un *un = (struct sockaddr_un *)ss;
+
+	memset(ss, 0, sizeof(*ss));
+	if(addr[0] == '/') {
+		if(strlen(addr) >= sizeof(un->sun_path)) { return 0; }
+		un->sun_family = AF_UNIX;
+		strcpy(un->sun_path, addr);
+		return sizeof(*un);
+	}
+	if(strchr(addr, ':')) {
+		in6->sin6_family = AF_INET6;
+		in6->sin6_port = htons(port);
+		if(inet_pton(AF_INET6, addr, &in6->sin6_addr) != 1) { return 0; }
+		return sizeof(*in6);
+	}
+	in->sin_family = AF_INET;
+	in->sin_port = htons(port);
+	if(inet_pton(AF_INET, addr, &in->sin_addr) != 1) { return 0; }
+	return sizeof(*in);
+}
+
+// Open our own listening socket, MHD is handed the descriptor
+// With SO_REUSEPORT every daemon bound this way gets its own accept queue, the kernel spreads new connections across them
+// An IPv6 listener is IPv6 only, so that an IPv4 listener can share its port (dual stack)
+static int listen_socket(const struct sockaddr_storage *ss, socklen_t sslen, int reuse_port)
+{
+	int fd, one = 1;
+	const char *path;
+	struct stat st;
+
+	fd = socket(ss->ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(fd < 0) { return -1; }
+
+	if(ss->ss_family == AF_UNIX) {
+		// A stale socket from a previous run would make bind() fail, anything else at that path is left alone
+		path = ((struct sockaddr_un *)ss)->sun_path;
+		if(lstat(path, &st) == 0) {
+			if(!S_ISSOCK(st.st_mode)) {
+				fprintf(stderr, "%s exists and is not a socket!\n", path);
+				close(fd);
+				return -1;
+			}
+			unlink(path);
+		}
+	} else {
+		if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0) { close(fd); return -1; }
+		if(reuse_port && (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0)) { close(fd); return -1; }
+		if((ss->ss_family == AF_INET6) && (setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &one, sizeof(one)) != 0)) { close(fd); return -1; }
+	}
+
+	if( (bind(fd, (const struct sockaddr *)ss, sslen) != 0) ||
+		(listen(fd, SOMAXCONN) != 0) ) {
+		close(fd);
+		return -1;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	return fd;
 }
 
 // Consider MHD_OPTION_CONNECTION_LIMIT here too
 // Maximum number of concurrent connections to accept (followed by an unsigned int).
 // The default is FD_SETSIZE - 4 (the maximum number of file descriptors supported by select minus four for stdin, stdout, stderr and the server socket).
 // In other words, the default is as large as possible.
-int searest_start(sri_t *ws, char *ip4addr, unsigned short port, void *sri_user_data)
+static struct MHD_Daemon* start_daemon(sri_t *ws, int listen_fd, void *sri_user_data)
 {
 #ifdef USEMHDOPTS
 	int i;
 	struct MHD_OptionItem *mhdops;
 #endif
 	//struct MHD_OptionItem mhdops[12];
-	struct sockaddr_in server;
+	struct MHD_Daemon *mhd;
 
 	// https://www.gnu.org/software/libmicrohttpd/manual/libmicrohttpd.html
 	// https://www.gnu.org/software/libmicrohttpd/manual/html_node/microhttpd_002dconst.html
 
-	if(searest_node_count(ws) == 0) { return 1; }
-
-	ws->sri_user_data = sri_user_data;
-
-	memset(&server, 0, sizeof(server));
-	server.sin_family = AF_INET;
-	server.sin_port = htons(port);
-	if(!ip4addr) { server.sin_addr.s_addr = INADDR_ANY; }
-	else { inet_pton(AF_INET, ip4addr, &server.sin_addr); }
-
 #ifdef USEMHDOPTS
 	i=0; mhdops=NULL;
 	mhdops = realloc(mhdops, (i+1)*sizeof(struct MHD_OptionItem));
-	mhdops[i].option = MHD_OPTION_SOCK_ADDR;
-	mhdops[i].value = (intptr_t)&server;
+	mhdops[i].option = MHD_OPTION_LISTEN_SOCKET;
+	mhdops[i].value = listen_fd;
 	mhdops[i++].ptr_value = NULL;
 
 	mhdops = realloc(mhdops, (i+1)*sizeof(struct MHD_OptionItem));
@@ -413,6 +825,11 @@ int searest_start(sri_t *ws, char *ip4addr, unsigned short port, void *sri_user_
 	mhdops[i].value = (intptr_t)&uhd_request_completed;
 	mhdops[i++].ptr_value = sri_user_data;
 
+	mhdops = realloc(mhdops, (i+1)*sizeof(struct MHD_OptionItem));
+	mhdops[i].option = MHD_OPTION_NOTIFY_CONNECTION;
+	mhdops[i].value = (intptr_t)&uhd_connection_notify;
+	mhdops[i++].ptr_value = ws;
+
 	mhdops = realloc(mhdops, (i+1)*sizeof(struct MHD_OptionItem));
 	mhdops[i].option = MHD_OPTION_CONNECTION_TIMEOUT;
 	mhdops[i].value = ws->inactivity_timeout;
@@ -423,6 +840,18 @@ int searest_start(sri_t *ws, char *ip4addr, unsigned short port, void *sri_user_
 	mhdops[i].value = ws->conn_limit;
 	mhdops[i++].ptr_value = NULL;
 
+	mhdops = realloc(mhdops, (i+1)*sizeof(struct MHD_OptionItem));
+	mhdops[i].option = MHD_OPTION_CONNECTION_MEMORY_LIMIT;
+	mhdops[i].value = ws->conn_memory_limit;
+	mhdops[i++].ptr_value = NULL;
+
+	if(ws->thread_pool_size > 1) {
+		mhdops = realloc(mhdops, (i+1)*sizeof(struct MHD_OptionItem));
+		mhdops[i].option = MHD_OPTION_THREAD_POOL_SIZE;
+		mhdops[i].value = ws->thread_pool_size;
+		mhdops[i++].ptr_value = NULL;
+	}
+
 	if(ws->https_cert && ws->https_key) {
 		mhdops = realloc(mhdops, (i+1)*sizeof(struct MHD_OptionItem));
 		mhdops[i].option = MHD_OPTION_HTTPS_MEM_CERT;
@@ -447,54 +876,124 @@ int searest_start(sri_t *ws, char *ip4addr, unsigned short port, void *sri_user_
 	mhdops[i].value = 0;
 	mhdops[i++].ptr_value = NULL;
 
-	ws->mhd_srv = MHD_start_daemon (ws->socket_model | ws->ssl_flag, 0,
+	mhd = MHD_start_daemon (ws->socket_model | ws->ssl_flag | ws->suspend_flag, 0,
 				&uhd_client_connect, ws,
 				&uhd_request_started, ws,
-				//MHD_OPTION_SOCK_ADDR, &server,
 				MHD_OPTION_ARRAY, mhdops,
 				MHD_OPTION_END);
 #else
 	if(ws->https_cert && ws->https_key) {
 		if(ws->https_ca) {
-			ws->mhd_srv = MHD_start_daemon (ws->socket_model | ws->ssl_flag, 0,
+			mhd = MHD_start_daemon (ws->socket_model | ws->ssl_flag | ws->suspend_flag, 0,
 						&uhd_client_connect, ws,
 						&uhd_request_started, ws,
-						MHD_OPTION_SOCK_ADDR, &server, 
+						MHD_OPTION_LISTEN_SOCKET, listen_fd,
 						MHD_OPTION_URI_LOG_CALLBACK, &uhd_logger, sri_user_data,
 						MHD_OPTION_NOTIFY_COMPLETED, &uhd_request_completed, sri_user_data,
+						MHD_OPTION_NOTIFY_CONNECTION, &uhd_connection_notify, ws,
 						MHD_OPTION_CONNECTION_TIMEOUT, ws->inactivity_timeout,
 						MHD_OPTION_CONNECTION_LIMIT, ws->conn_limit,
+						MHD_OPTION_CONNECTION_MEMORY_LIMIT, ws->conn_memory_limit,
+						MHD_OPTION_THREAD_POOL_SIZE, ws->thread_pool_size,
 						MHD_OPTION_HTTPS_MEM_CERT, ws->https_cert,
 						MHD_OPTION_HTTPS_MEM_KEY, ws->https_key,
 						MHD_OPTION_HTTPS_MEM_TRUST, ws->https_ca,
 						MHD_OPTION_END);
 		} else {
-			ws->mhd_srv = MHD_start_daemon (ws->socket_model | ws->ssl_flag, 0,
+			mhd = MHD_start_daemon (ws->socket_model | ws->ssl_flag | ws->suspend_flag, 0,
 						&uhd_client_connect, ws,
 						&uhd_request_started, ws,
-						MHD_OPTION_SOCK_ADDR, &server, 
+						MHD_OPTION_LISTEN_SOCKET, listen_fd,
 						MHD_OPTION_URI_LOG_CALLBACK, &uhd_logger, sri_user_data,
 						MHD_OPTION_NOTIFY_COMPLETED, &uhd_request_completed, sri_user_data,
+						MHD_OPTION_NOTIFY_CONNECTION, &uhd_connection_notify, ws,
 						MHD_OPTION_CONNECTION_TIMEOUT, ws->inactivity_timeout,
 						MHD_OPTION_CONNECTION_LIMIT, ws->conn_limit,
+						MHD_OPTION_CONNECTION_MEMORY_LIMIT, ws->conn_memory_limit,
+						MHD_OPTION_THREAD_POOL_SIZE, ws->thread_pool_size,
 						MHD_OPTION_HTTPS_MEM_CERT, ws->https_cert,
 						MHD_OPTION_HTTPS_MEM_KEY, ws->https_key,
 						MHD_OPTION_END);
 		}
 	} else {
-		ws->mhd_srv = MHD_start_daemon (ws->socket_model | ws->ssl_flag, 0,
+		mhd = MHD_start_daemon (ws->socket_model | ws->ssl_flag | ws->suspend_flag, 0,
 						&uhd_client_connect, ws,
 						&uhd_request_started, ws,
-						MHD_OPTION_SOCK_ADDR, &server, 
+						MHD_OPTION_LISTEN_SOCKET, listen_fd,
 						MHD_OPTION_URI_LOG_CALLBACK, &uhd_logger, sri_user_data,
 						MHD_OPTION_NOTIFY_COMPLETED, &uhd_request_completed, sri_user_data,
+						MHD_OPTION_NOTIFY_CONNECTION, &uhd_connection_notify, ws,
 						MHD_OPTION_CONNECTION_TIMEOUT, ws->inactivity_timeout,
 						MHD_OPTION_CONNECTION_LIMIT, ws->conn_limit,
+						MHD_OPTION_CONNECTION_MEMORY_LIMIT, ws->conn_memory_limit,
+						MHD_OPTION_THREAD_POOL_SIZE, ws->thread_pool_size,
 						MHD_OPTION_END);
 	}
 #endif
 
-	if(!ws->mhd_srv) { return 2; }
+#ifdef USEMHDOPTS
+	free(mhdops);
+#endif
+	return mhd;
+}
+
+// Start one MHD daemon per listener, they share our nodes and settings
+// ipaddr (IPv4 or IPv6, NULL for every IPv4 address) and port is the first listener
+// return 0 on success
+int searest_start(sri_t *ws, char *ipaddr, unsigned short port, void *sri_user_data)
+{
+	int i;
+	socklen_t sslen;
+	struct sockaddr_storage ss;
+	srl_t *l;
+
+	if(searest_node_count(ws) == 0) { return 1; }
+
+	// The io_uring engine only speaks plain HTTP and answers every request right away
+	if((ws->engine == SR_ENGINE_URING) && (ws->ssl_flag || ws->suspend_flag)) { return 5; }
+
+	ws->sri_user_data = sri_user_data;
+
+	l = &ws->listeners[0];
+	if(l->addr) { free(l->addr); }
+	l->addr = strdup(ipaddr ? ipaddr : "0.0.0.0");
+	l->port = port;
+
+	for(i=0; i<ws->listener_count; i++) {
+		l = &ws->listeners[i];
+		sslen = listener_addr(&ss, l->addr, l->port);
+		if(sslen == 0) { searest_stop(ws); return 4; }
+		l->family = ss.ss_family;
+		l->fd = listen_socket(&ss, sslen, ws->reuse_port);
+		if(l->fd < 0) { searest_stop(ws); return 3; }
+#ifdef SEARESTURING
+		if(ws->engine == SR_ENGINE_URING) {
+			l->uring = sru_start(ws, l->fd, sri_user_data);
+			if(!l->uring) { searest_stop(ws); return 2; }
+			continue;
+		}
+#endif
+		l->mhd = start_daemon(ws, l->fd, sri_user_data);
+		if(!l->mhd) { searest_stop(ws); return 2; }
+	}
+
+	return 0;
+}
+
+// Listen on another IPv4/IPv6 address and port, or a unix socket path (port is ignored)
+// Must be called before searest_start()
+// return 0 on success
+int searest_add_listener(sri_t *ws, char *addr, unsigned short port)
+{
+	srl_t *l;
+
+	if(ws->listener_count >= SR_MAX_LISTENERS) { return 1; }
+
+	l = &ws->listeners[ws->listener_count++];
+	l->addr = strdup(addr);
+	l->port = port;
+	l->fd = -1;
+
 	return 0;
 }
 
@@ -521,6 +1020,12 @@ void searest_set_conn_limit(sri_t *ws, unsigned int limit)
 	ws->conn_limit = limit;
 }
 
+// Bigger connection memory means fewer, bigger upload callbacks
+void searest_set_conn_memory_limit(sri_t *ws, size_t limit)
+{
+	ws->conn_memory_limit = limit;
+}
+
 void searest_set_inactivity_timeout(sri_t *ws, int timeout)
 {
 	ws->inactivity_timeout = timeout;
@@ -531,6 +1036,41 @@ void searest_set_internal_select(sri_t *ws)
 	ws->socket_model = MHD_USE_SELECT_INTERNALLY;
 }
 
+// A fixed pool of threads, each running its own epoll loop over a share of the connections
+// Connections are no longer capped at FD_SETSIZE
+void searest_set_thread_pool(sri_t *ws, unsigned int size)
+{
+	ws->socket_model = MHD_USE_EPOLL_INTERNAL_THREAD;
+	ws->thread_pool_size = size;
+	if(ws->conn_limit == FD_SETSIZE-4) { ws->conn_limit = SR_EPOLL_CONN_LIMIT; }
+}
+
+// Serve requests with io_uring instead of libmicrohttpd (see searest_uring.c)
+// The thread pool size sets the number of rings, the socket model is ignored
+// return 0 on success, 1 if searest was built without -DSEARESTURING
+int searest_set_engine_uring(sri_t *ws)
+{
+#ifdef SEARESTURING
+	ws->engine = SR_ENGINE_URING;
+	return 0;
+#else
+	return 1;
+#endif
+}
+
+// Let several daemons bind the same address (see listen_socket())
+void searest_set_reuse_port(sri_t *ws)
+{
+	ws->reuse_port = 1;
+}
+
+// Allow node callbacks to defer responses with srci_suspend()
+// This is not compatible with MHD_USE_THREAD_PER_CONNECTION
+void searest_set_suspend_resume(sri_t *ws)
+{
+	ws->suspend_flag = MHD_ALLOW_SUSPEND_RESUME;
+}
+
 void searest_set_addr_cb(sri_t *ws, void *func)
 {
 	ws->addr_cb = func;
@@ -538,8 +1078,21 @@ void searest_set_addr_cb(sri_t *ws, void *func)
 
 void searest_stop(sri_t *ws)
 {
-	if(ws->mhd_srv) { MHD_stop_daemon(ws->mhd_srv); }
-	ws->mhd_srv = NULL;
+	int i;
+	srl_t *l;
+
+	for(i=0; i<ws->listener_count; i++) {
+		l = &ws->listeners[i];
+#ifdef SEARESTURING
+		if(l->uring) { sru_stop(l->uring); }
+		l->uring = NULL;
+#endif
+		if(l->mhd) { MHD_stop_daemon(l->mhd); }	// MHD closes the listening socket
+		else if(l->fd >= 0) { close(l->fd); }
+		if((l->fd >= 0) && (l->family == AF_UNIX)) { unlink(l->addr); }
+		l->mhd = NULL;
+		l->fd = -1;
+	}
 }
 
 sri_t* searest_new(int urlmin, int urlmax, size_t contentmax)
@@ -552,6 +1105,9 @@ sri_t* searest_new(int urlmin, int urlmax, size_t contentmax)
 
 	ws->socket_model = MHD_USE_THREAD_PER_CONNECTION;
 	ws->conn_limit = FD_SETSIZE-4;  //-1 ??
+	ws->listeners[0].fd = -1;	// filled in by searest_start()
+	ws->listener_count = 1;
+	ws->conn_memory_limit = SR_CONN_MEMORY_LIMIT;
 	ws->min_url_len = urlmin;
 	ws->max_url_len = urlmax;
 	ws->max_content_length = contentmax;
@@ -561,8 +1117,11 @@ sri_t* searest_new(int urlmin, int urlmax, size_t contentmax)
 
 void searest_del(sri_t *ws)
 {
+	int i;
+
 	searest_stop(ws);
 	searest_node_destroy_all(ws);
+	for(i=0; i<ws->listener_count; i++) { free(ws->listeners[i].addr); }
 	if(ws->https_cert) { free(ws->https_cert); }
 	if(ws->https_key) { free(ws->https_key); }
 	if(ws->https_ca) { free(ws->https_ca); }
@@ -35,32 +35,56 @@
 #define METHOD_PUT	(3)
 #define METHOD_DEL	(4)
 #define METHOD_OPT	(5)
+#define METHOD_HEAD	(6)
 
 #define HDRASTR "Accept"
 #define HDRCTSTR "Content-Type"
 #define HDRCLSTR "Content-Length"
 #define HDRAUTHSTR "Authorization"
+#define HDRTESTR "Transfer-Encoding"
+#define HDRRANGESTR "Range"
 
 #define MIMETYPETXTPLAINSTR "text/plain"
 #define MIMETYPEAPPBINSTR "application/octet-stream"
 #define MIMETYPEAPPJSONSTR "application/json"
 #define MIMETYPEAPPXMLSTR "application/xml"
 
+// MHD reads request bodies in chunks of about this size per connection (MHD default: 32 KiB)
+#define SR_CONN_MEMORY_LIMIT	(256*1024)
+
+// select() can not go past FD_SETSIZE, epoll can
+#define SR_EPOLL_CONN_LIMIT	(65536)
+
 #define SR_IP_ACCEPT	(MHD_YES)
 #define SR_IP_DENY		(MHD_NO)
 
 #define SR_ADDR_CALLBACK(CB)	int (CB)(char *, void *);
 #define SR_NODE_CALLBACK(CB)	char* (CB)(char *, int, void *, void *, void *);
+#define SR_FREE_CALLBACK(CB)	void (CB)(void *);
+#define SR_UPLOAD_CALLBACK(CB)	int (CB)(char *, int, void *, const char *, size_t, void *, void *);
+#define SR_PRECHECK_CALLBACK(CB)	char* (CB)(char *, int, void *, void *, void *);
+#define SR_READER_CALLBACK(CB)	ssize_t (CB)(void *, uint64_t, char *, size_t);
+
+// Return values of an upload callback, anything else is an HTTP status to reject the upload with
+#define SR_UPLOAD_BUFFER	(0)		// searest keeps the chunk for the node callback
+#define SR_UPLOAD_CONSUMED	(1)		// the upload callback has dealt with the chunk
+
+// Extra response headers a node can set per request
+#define SR_MAX_RESPONSE_HEADERS (4)
+
+// Access counters are kept per node id, each on its own cache line
+#define SR_MAX_NODES (512)
 
 typedef struct searest_node {
 	unsigned int num;
+	int id;
 	int disabled;
 	char *root;
+	size_t rootlen;
 	SR_NODE_CALLBACK(*cb);
+	SR_UPLOAD_CALLBACK(*upload_cb);
+	SR_PRECHECK_CALLBACK(*precheck_cb);
 	void *nud;
-
-	time_t last_atime;
-	unsigned long acount;
 #ifdef SRNODECHRONOMETRY
 	int dai;	//duration array index
 	long da[TIMESLOTS];
@@ -71,25 +95,54 @@ typedef struct searest_node {
 	struct searest_node *prev;
 } srn_t;
 
+#define SR_ENGINE_MHD	(0)
+#define SR_ENGINE_URING	(1)		// requires -DSEARESTURING
+
+// Every listener gets its own MHD daemon (or io_uring engine)
+#define SR_MAX_LISTENERS (8)
+typedef struct searest_listener {
+	char *addr;		// IPv4, IPv6 or a unix socket path
+	unsigned short port;
+	int family;
+	int fd;
+	struct MHD_Daemon *mhd;
+	void *uring;	// the io_uring engine serving this listener
+} srl_t;
+
 typedef struct searest_instance {
 	void *sri_user_data;
 	SR_ADDR_CALLBACK(*addr_cb);
-	struct MHD_Daemon *mhd_srv;
+	srl_t listeners[SR_MAX_LISTENERS];	// [0] is the address given to searest_start()
+	int listener_count;
 
 	char *https_cert;
 	char *https_key;
 	char *https_ca;
 	int ssl_flag;
+	int suspend_flag;
 	int socket_model;
+	int engine;
+	unsigned int thread_pool_size;
+	int reuse_port;
 	int inactivity_timeout;
 	unsigned int conn_limit;
+	size_t conn_memory_limit;
 	int min_url_len;
 	int max_url_len;
 	size_t max_content_length;
 
 	srn_t *nodelist_head;
+	struct searest_routes *routes;	// Immutable, rebuilt and swapped by searest_node_add()
 } sri_t;
 
+// Per connection scratch memory for request strings, reset after every request
+#define SR_ARENA_SIZE (2048)
+typedef struct searest_arena {
+	size_t used;
+	void *spill;	// heap blocks for whatever did not fit
+	char buf[SR_ARENA_SIZE];
+} sra_t;
+
 typedef struct searest_conn_info {
 	char *ip;
 	int method_type;
@@ -97,21 +150,54 @@ typedef struct searest_conn_info {
 	int urllen;
 	char *accept;			//request - from browser
 	char *auth;				//request - from browser
+	char *range;			//request - from browser
 
 	// Evreyhting we need for processing uploaded data
 	size_t content_length;
+	int chunked;
+	int rejected;			// answered in the header phase, the body is discarded
+	int upload_status;		// set when the upload callback rejected the body
+	srn_t *upload_node;
+	void *node_data;		// for the node callbacks to use during one request
 	unsigned char *post_data;
 	size_t post_data_len;
+	size_t post_data_cap;
 
 	char *content_type;	//response - to browser
 	char *allow;		//response - to browser
 	int cors;
+	char *hdr_names[SR_MAX_RESPONSE_HEADERS];	//response - see srci_add_response_header()
+	char *hdr_values[SR_MAX_RESPONSE_HEADERS];
+	int hdr_count;
+	size_t head_length;		//response - see srci_set_head_length()
+	int head_length_set;
 	int return_code;
 	char *return_page;
+
+	// Response body owned by the node (see srci_set_return_data())
+	const void *return_data;
+	size_t return_data_len;
+	SR_FREE_CALLBACK(*return_data_free);
+	void *return_data_cls;
+
+	// Response body produced as the client drains it (see srci_set_return_reader())
+	uint64_t reader_size;
+	size_t reader_block;
+	SR_READER_CALLBACK(*reader);
+	SR_FREE_CALLBACK(*reader_free);
+	void *reader_cls;
+
+	// Deferred responses (see srci_suspend()/srci_resume())
+	struct MHD_Connection *connection;
+	int pending;
+	int suspended;
+
+	sra_t *arena;
 } srci_t;
 
 char* srci_get_client_ip(srci_t *ri);
 char *srci_get_browser_auth(srci_t *ri);
+char* srci_get_range(srci_t *ri);
 int srci_browser_requests_text(srci_t *ri);
 int srci_browser_requests_xml(srci_t *ri);
 int srci_browser_requests_json(srci_t *ri);
@@ -119,19 +205,35 @@ int srci_get_method_type(srci_t *ri);
 void srci_set_response_content_type(srci_t *ri, char *ct);
 void srci_set_response_allow(srci_t *ri, char *a);
 void srci_set_response_cors(srci_t *ri);
+int srci_add_response_header(srci_t *ri, const char *name, const char *value);
+void srci_set_head_length(srci_t *ri, size_t len);
 
 const unsigned char* srci_get_post_data_ptr(srci_t *ri);
 size_t srci_get_post_data_size(srci_t *ri);
+int srci_get_upload_status(srci_t *ri);
+void* srci_alloc(srci_t *ri, size_t len);
+void srci_set_node_data(srci_t *ri, void *data);
+void* srci_get_node_data(srci_t *ri);
 void srci_set_return_code(srci_t *ri, int code);
+void srci_set_return_data(srci_t *ri, const void *data, size_t len, void *free_cb, void *cls);
+void srci_set_return_reader(srci_t *ri, uint64_t size, size_t block, void *reader, void *free_cb, void *cls);
+void srci_suspend(srci_t *ri);
+void srci_resume(srci_t *ri, char *page);
 
 void searest_set_https_cert(sri_t *ws, const char *cert);
 void searest_set_https_key(sri_t *ws, const char *key);
 void searest_set_https_ca(sri_t *ws, const char *ca);
 void searest_set_inactivity_timeout(sri_t *ws, int timeout);
 void searest_set_internal_select(sri_t *ws);
+void searest_set_thread_pool(sri_t *ws, unsigned int size);
+void searest_set_conn_memory_limit(sri_t *ws, size_t limit);
+void searest_set_reuse_port(sri_t *ws);
+void searest_set_suspend_resume(sri_t *ws);
 void searest_set_addr_cb(sri_t *ws, void *func);
 void searest_stop(sri_t *ws);
-int searest_start(sri_t *ws, char *ip4addr, unsigned short port, void *sri_user_data);
+int searest_start(sri_t *ws, char *ipaddr, unsigned short port, void *sri_user_data);
+int searest_add_listener(sri_t *ws, char *addr, unsigned short port);
+int searest_set_engine_uring(sri_t *ws);
 sri_t* searest_new(int urlmin, int urlmax, size_t contentmax);
 void searest_del(sri_t *ws);
 
@@ -142,6 +244,10 @@ long searest_node_get_avg_duration(sri_t *ws, char *rootname);
 int searest_node_set_disabled(sri_t *ws, char *rootname);
 int searest_node_set_enabled(sri_t *ws, char *rootname);
 int searest_node_add(sri_t *ws, char *rootname, void *func, void *node_user_data);
+int searest_node_set_upload_cb(sri_t *ws, char *rootname, void *func);
+int searest_node_set_precheck_cb(sri_t *ws, char *rootname, void *func);
 unsigned int searest_node_count(sri_t *ws);
+unsigned long searest_node_get_access_count(sri_t *ws, char *rootname);
+time_t searest_node_get_last_access(sri_t *ws, char *rootname);
 
 #endif
@@ -0,0 +1,157 @@
+/*
+	SeaRest is a RESTFul service framework leveraging libmicrohttpd
+	Copyright (C) 2022 Brett Kuskie <fullaxx@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; version 2 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// Size classed upload buffers
+// Every class is a power of two, buffers are cached on a free list per class when released
+// Large classes are mmap()'d on their own, so big uploads never fragment the heap
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "searest.h"
+
+#define SRBP_MIN_SHIFT	(12)	// 4 KiB
+#define SRBP_MMAP_SHIFT	(18)	// 256 KiB and up come from mmap()
+#define SRBP_MAX_SHIFT	(34)	// 16 GiB
+#define SRBP_CLASSES	(SRBP_MAX_SHIFT - SRBP_MIN_SHIFT + 1)
+#define SRBP_CACHE		(16)	// small buffers kept per class
+#define SRBP_MMAP_CACHE	(2)		// large buffers kept per class
+
+// Sits in front of every buffer we hand out
+typedef union srbp_hdr {
+	struct {
+		union srbp_hdr *next;
+		int cls;
+	} h;
+	long double align;
+} srbp_hdr_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	srbp_hdr_t *free;
+	int count;
+} srbp_class_t;
+
+static srbp_class_t g_classes[SRBP_CLASSES];
+static pthread_once_t g_srbp_once = PTHREAD_ONCE_INIT;
+static size_t g_srbp_page = 4096;
+
+static void srbp_init(void)
+{
+	int i;
+	long page = sysconf(_SC_PAGESIZE);
+
+	if(page > 0) { g_srbp_page = page; }
+	for(i=0; i<SRBP_CLASSES; i++) { pthread_mutex_init(&g_classes[i].lock, NULL); }
+}
+
+static inline size_t class_size(int cls)
+{
+	return ((size_t)1 << (cls + SRBP_MIN_SHIFT));
+}
+
+static inline int class_is_mmap(int cls)
+{
+	return ((cls + SRBP_MIN_SHIFT) >= SRBP_MMAP_SHIFT);
+}
+
+// return the smallest class that holds len bytes after the header, -1 if none does
+static int class_for(size_t len)
+{
+	int cls;
+
+	for(cls=0; cls<SRBP_CLASSES; cls++) {
+		if(class_size(cls) - sizeof(srbp_hdr_t) >= len) { return cls; }
+	}
+
+	return -1;
+}
+
+// Get a buffer of at least len bytes, *cap is set to its usable size
+// return NULL on failure
+void* srbp_get(size_t len, size_t *cap)
+{
+	int cls;
+	srbp_class_t *c;
+	srbp_hdr_t *b = NULL;
+	void *m;
+
+	pthread_once(&g_srbp_once, &srbp_init);
+
+	cls = class_for(len);
+	if(cls < 0) { return NULL; }
+	c = &g_classes[cls];
+
+	pthread_mutex_lock(&c->lock);
+	if(c->free) {
+		b = c->free;
+		c->free = b->h.next;
+		c->count--;
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	if(!b) {
+		if(class_is_mmap(cls)) {
+			m = mmap(NULL, class_size(cls), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+			if(m == MAP_FAILED) { return NULL; }
+			b = m;
+		} else {
+			b = malloc(class_size(cls));
+			if(!b) { return NULL; }
+		}
+	}
+
+	b->h.cls = cls;
+	b->h.next = NULL;
+	if(cap) { *cap = class_size(cls) - sizeof(srbp_hdr_t); }
+	return (b + 1);
+}
+
+// Return a buffer to its class, or to the system if the class cache is full
+void srbp_put(void *p)
+{
+	int cls, max;
+	srbp_class_t *c;
+	srbp_hdr_t *b;
+
+	if(!p) { return; }
+	b = ((srbp_hdr_t *)p) - 1;
+	cls = b->h.cls;
+	c = &g_classes[cls];
+	max = class_is_mmap(cls) ? SRBP_MMAP_CACHE : SRBP_CACHE;
+
+	// A cached mmap() buffer gives its pages back, only the page holding the header stays resident
+	if(class_is_mmap(cls)) { madvise((char *)b + g_srbp_page, class_size(cls) - g_srbp_page, MADV_DONTNEED); }
+
+	pthread_mutex_lock(&c->lock);
+	if(c->count < max) {
+		b->h.next = c->free;
+		c->free = b;
+		c->count++;
+		b = NULL;
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	if(!b) { return; }
+	if(class_is_mmap(cls)) { munmap(b, class_size(cls)); }
+	else { free(b); }
+}
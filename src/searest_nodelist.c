@@ -16,49 +16,216 @@
 	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
 
+#define _GNU_SOURCE		// sched_getcpu()
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
 
 #include "searest.h"
 
-pthread_mutex_t nodelist_mutex;
+// Request routing
+// The node list is only walked when a node is added, it is then compiled into a byte trie
+// The trie is immutable, readers load it without a lock and a new one is swapped in by searest_node_add()
+// Replaced tables are kept until searest_node_destroy_all(), nodes are only added at startup
+
+typedef struct {
+	unsigned char c;
+	int state;
+} sre_t;
+
+typedef struct {
+	int edge;		// first edge in the edge array
+	int edges;		// number of edges, sorted by byte
+	srn_t *match;	// node whose root ends here
+} srs_t;
+
+typedef struct searest_routes {
+	srs_t *states;
+	sre_t *edges;
+	struct searest_routes *retired;
+} srrt_t;
+
+pthread_mutex_t nodelist_mutex = PTHREAD_MUTEX_INITIALIZER;
 void nl_lock(void) { pthread_mutex_lock(&nodelist_mutex); }
 void nl_unlock(void) { pthread_mutex_unlock(&nodelist_mutex); }
 
-srn_t* searest_node_find(sri_t *ws, char *rootname)
+static int g_node_next_id = 0;
+
+// Only used while building
+typedef struct trie_build_node {
+	srn_t *match;
+	struct trie_build_node *kids[256];
+} tbn_t;
+
+static void tbn_free(tbn_t *t)
+{
+	int i;
+	for(i=0; i<256; i++) { if(t->kids[i]) { tbn_free(t->kids[i]); } }
+	free(t);
+}
+
+// Must be called with the nodelist lock held
+static srrt_t* routes_build(sri_t *ws)
 {
-	size_t nodelen;
+	int i, head, tail, nstates = 1, nedges = 0;
+	unsigned char *c;
 	srn_t *cursor;
-	srn_t *answer = NULL;
+	tbn_t *root, *t, **queue;
+	srrt_t *rt;
+
+	root = calloc(1, sizeof(tbn_t));
+	if(!root) { fprintf(stderr, "calloc() failed!"); exit(EXIT_FAILURE); }
+
+	// The first node added wins if one root is a prefix of another, same as the old list walk
+	for(cursor=ws->nodelist_head; cursor; cursor=cursor->next) {
+		t = root;
+		for(c=(unsigned char *)cursor->root; *c; c++) {
+			if(!t->kids[*c]) {
+				t->kids[*c] = calloc(1, sizeof(tbn_t));
+				if(!t->kids[*c]) { fprintf(stderr, "calloc() failed!"); exit(EXIT_FAILURE); }
+				nstates++;
+			}
+			t = t->kids[*c];
+		}
+		if(!t->match) { t->match = cursor; }
+	}
 
-//	LOCK
-	nl_lock();
+	rt = calloc(1, sizeof(srrt_t));
+	queue = calloc(nstates, sizeof(tbn_t *));
+	if(rt) { rt->states = calloc(nstates, sizeof(srs_t)); }
+	if(rt) { rt->edges = calloc(nstates, sizeof(sre_t)); }
+	if(!rt || !queue || !rt->states || !rt->edges) { fprintf(stderr, "calloc() failed!"); exit(EXIT_FAILURE); }
+
+	// Breadth first, so that the edges of every state are next to each other
+	head = 0; tail = 0;
+	queue[tail++] = root;
+	while(head < tail) {
+		t = queue[head];
+		rt->states[head].match = t->match;
+		rt->states[head].edge = nedges;
+		for(i=0; i<256; i++) {
+			if(!t->kids[i]) { continue; }
+			rt->edges[nedges].c = i;
+			rt->edges[nedges].state = tail;
+			nedges++;
+			queue[tail++] = t->kids[i];
+		}
+		rt->states[head].edges = nedges - rt->states[head].edge;
+		head++;
+	}
 
-	cursor = ws->nodelist_head;
-	while(cursor) {
-		nodelen = strlen(cursor->root);
-		if(strncmp(rootname, cursor->root, nodelen) == 0) { answer = cursor; break; }
-		cursor = cursor->next;
+	free(queue);
+	tbn_free(root);
+	return rt;
+}
+
+static void routes_free(srrt_t *rt)
+{
+	srrt_t *next;
+
+	while(rt) {
+		next = rt->retired;
+		free(rt->states);
+		free(rt->edges);
+		free(rt);
+		rt = next;
 	}
+}
 
-	nl_unlock();
-//	UNLOCK
+// Lock free, walks the current routing table
+srn_t* searest_node_find(sri_t *ws, char *rootname)
+{
+	int i, s = 0;
+	unsigned char *c;
+	srs_t *st;
+	srn_t *m, *answer = NULL;
+	srrt_t *rt;
+
+	rt = __atomic_load_n(&ws->routes, __ATOMIC_ACQUIRE);
+	if(!rt) { return NULL; }
+
+	for(c=(unsigned char *)rootname; *c; c++) {
+		st = &rt->states[s];
+		for(i=0; i<st->edges; i++) {
+			if(rt->edges[st->edge+i].c >= *c) { break; }
+		}
+		if((i == st->edges) || (rt->edges[st->edge+i].c != *c)) { break; }
+		s = rt->edges[st->edge+i].state;
+
+		m = rt->states[s].match;
+		if(m && (!answer || (m->num < answer->num))) { answer = m; }
+	}
 
 	return answer;
 }
 
 size_t searest_node_len(srn_t *n)
 {
-	return strlen(n->root);
+	return n->rootlen;
 }
 
+// Per node access counters, striped by cpu so that routing shares no cache line between cpus
+// The adds stay atomic (a thread may migrate mid update, cpus past SRNS_STRIPES share a stripe) but are not contended
+// Readers sum the stripes
+#define SRNS_STRIPES (32)
+typedef struct {
+	unsigned long acount;
+	time_t atime;
+} srns_t;
+
+typedef struct {
+	srns_t nodes[SR_MAX_NODES];
+} __attribute__((aligned(64))) srnstripe_t;
+
+static srnstripe_t g_node_stats[SRNS_STRIPES];
+
 void searest_node_set_access(srn_t *n)
 {
-	n->last_atime = time(NULL);
-	n->acount++;
+	int cpu;
+	time_t now;
+	srns_t *s;
+
+	if(n->id < 0) { return; }
+	cpu = sched_getcpu();
+	if(cpu < 0) { cpu = 0; }
+	s = &g_node_stats[cpu % SRNS_STRIPES].nodes[n->id];
+
+	// Only dirty the time once a second
+	now = time(NULL);
+	if(__atomic_load_n(&s->atime, __ATOMIC_RELAXED) != now) { __atomic_store_n(&s->atime, now, __ATOMIC_RELAXED); }
+	__atomic_fetch_add(&s->acount, 1, __ATOMIC_RELAXED);
+}
+
+unsigned long searest_node_get_access_count(sri_t *ws, char *rootname)
+{
+	int i;
+	unsigned long total = 0;
+	srn_t *n = searest_node_find(ws, rootname);
+
+	if(!n || (n->id < 0)) { return 0; }
+	for(i=0; i<SRNS_STRIPES; i++) {
+		total += __atomic_load_n(&g_node_stats[i].nodes[n->id].acount, __ATOMIC_RELAXED);
+	}
+
+	return total;
+}
+
+time_t searest_node_get_last_access(sri_t *ws, char *rootname)
+{
+	int i;
+	time_t t, last = 0;
+	srn_t *n = searest_node_find(ws, rootname);
+
+	if(!n || (n->id < 0)) { return 0; }
+	for(i=0; i<SRNS_STRIPES; i++) {
+		t = __atomic_load_n(&g_node_stats[i].nodes[n->id].atime, __ATOMIC_RELAXED);
+		if(t > last) { last = t; }
+	}
+
+	return last;
 }
 
 #ifdef SRNODECHRONOMETRY
@@ -121,12 +288,17 @@ int searest_node_is_disabled(srn_t *n)
 	return n->disabled;
 }
 
+// return 3 if we are out of node ids (see SR_MAX_NODES)
 int searest_node_add(sri_t *ws, char *rootname, void *func, void *node_user_data)
 {
+	int id;
 	srn_t *cursor;
+	srrt_t *rt;
 
 	if(!rootname) { return 1; }
 	if(!func) { return 2; }
+	id = __sync_fetch_and_add(&g_node_next_id, 1);
+	if(id >= SR_MAX_NODES) { return 3; }
 
 //	LOCK
 	nl_lock();
@@ -144,16 +316,45 @@ int searest_node_add(sri_t *ws, char *rootname, void *func, void *node_user_data
 		cursor->num = cursor->prev->num + 1;
 	}
 
+	cursor->id = id;
 	cursor->root = strdup(rootname);
+	cursor->rootlen = strlen(rootname);
 	cursor->cb = func;
 	cursor->nud = node_user_data;
 
+	// Publish a new routing table, requests in flight may still be walking the old one
+	rt = routes_build(ws);
+	rt->retired = ws->routes;
+	__atomic_store_n(&ws->routes, rt, __ATOMIC_RELEASE);
+
 	nl_unlock();
 //	UNLOCK
 
 	return 0;
 }
 
+// Have func see every upload chunk for this node as it arrives (see SR_UPLOAD_CALLBACK)
+int searest_node_set_upload_cb(sri_t *ws, char *rootname, void *func)
+{
+	srn_t *n = searest_node_find(ws, rootname);
+	if(!n) { return 1; }
+
+	n->upload_cb = func;
+
+	return 0;
+}
+
+// Have func look at each request for this node once its headers are in (see searest_request_precheck())
+int searest_node_set_precheck_cb(sri_t *ws, char *rootname, void *func)
+{
+	srn_t *n = searest_node_find(ws, rootname);
+	if(!n) { return 1; }
+
+	n->precheck_cb = func;
+
+	return 0;
+}
+
 void searest_node_destroy_all(sri_t *ws)
 {
 	srn_t *prev;
@@ -170,6 +371,10 @@ void searest_node_destroy_all(sri_t *ws)
 		cursor = cursor->next;
 		free(prev);
 	}
+	ws->nodelist_head = NULL;
+
+	routes_free(ws->routes);
+	ws->routes = NULL;
 
 	nl_unlock();
 //	UNLOCK
@@ -0,0 +1,728 @@
+/*
+	SeaRest is a RESTFul service framework leveraging libmicrohttpd
+	Copyright (C) 2022 Brett Kuskie <fullaxx@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; version 2 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+// An io_uring engine for searest, selected with searest_set_engine_uring()
+// Each thread has its own ring: one multishot accept on the shared listening socket,
+// one multishot recv per connection drawing from a buffer ring registered with the kernel,
+// and every SQE queued while handling a batch of completions goes out in a single submit
+// HTTPS, suspend/resume and chunked uploads are left to the libmicrohttpd engine
+#ifdef SEARESTURING
+
+#define _GNU_SOURCE		// memmem()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <liburing.h>
+
+#include "searest.h"
+
+// Found in searest.c
+int searest_sockaddr_str (const struct sockaddr *sa, char *ip_str, size_t len);
+int searest_request_init(sri_t *ws, srci_t *ri, sra_t *arena, const char *url, const char *method,
+const char *accept, const char *auth, const char *content_length, const char *te, const char *range);
+char* searest_request_precheck(sri_t *ws, srci_t *ri, void *sri_user_data);
+int searest_request_upload(sri_t *ws, srci_t *ri, const char *data, size_t len);
+char* searest_request_process(sri_t *ws, srci_t *ri, void *sri_user_data);
+void searest_request_done(srci_t *ri);
+
+#define SRU_QUEUE_DEPTH	(4096)
+#define SRU_BUF_GROUP	(0)
+#define SRU_BUF_COUNT	(1024)	// must be a power of 2
+#define SRU_BUF_SIZE	(4096)
+#define SRU_HEAD_MAX	(8192)	// request line and headers, plus anything pipelined behind them
+#define SRU_RESP_HEAD	(1024)
+
+// What a completion belongs to, kept in the low bits of its user_data next to the connection pointer
+#define SRU_OP_ACCEPT	(1)
+#define SRU_OP_RECV		(2)
+#define SRU_OP_SEND		(3)
+#define SRU_OP_TICK		(4)
+#define SRU_OP_WAKE		(5)
+#define SRU_OP_MASK		(7)
+
+#define SRU_HEAD		(0)		// reading the request line and headers
+#define SRU_BODY		(1)		// reading the request body
+#define SRU_SEND		(2)		// sending the response
+#define SRU_CLOSING		(3)		// waiting for our SQEs to complete
+
+typedef struct sru_conn {
+	int fd;
+	int state;
+	int active;		// ri holds a request
+	int keepalive;
+	int interim;	// sending 100 Continue
+	int recving;
+	int sending;
+	time_t last_active;
+	size_t body_left;
+	srci_t ri;
+	sra_t arena;
+	char ip[INET6_ADDRSTRLEN];
+	char in[SRU_HEAD_MAX];
+	size_t inlen;
+	char out[SRU_RESP_HEAD];
+	struct iovec iov[2];
+	struct msghdr msg;
+	struct sru_conn *next;
+	struct sru_conn *prev;
+} sru_conn_t;
+
+struct sru_engine;
+
+typedef struct sru_thread {
+	struct sru_engine *e;
+	pthread_t thread;
+	struct io_uring ring;
+	int ringed;
+	struct io_uring_buf_ring *br;
+	char *bufs;
+	int wakefd;
+	uint64_t wakeval;
+	int stop;
+	int accepting;	// the multishot accept is armed
+	int ticking;	// the inactivity tick is armed
+	struct __kernel_timespec tick;
+	sru_conn_t *conns;
+} sru_thread_t;
+
+typedef struct sru_engine {
+	sri_t *ws;
+	void *sri_user_data;
+	int listen_fd;
+	unsigned int conncount;
+	int count;
+	sru_thread_t *threads;
+} sru_t;
+
+// return NULL if the submission queue is still full after a flush
+static struct io_uring_sqe* sru_sqe(sru_thread_t *t)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&t->ring);
+
+	// The submission queue is full, flush it and try again
+	if(!sqe) {
+		io_uring_submit(&t->ring);
+		sqe = io_uring_get_sqe(&t->ring);
+	}
+
+	return sqe;
+}
+
+// An accept or tick that could not be queued is queued again by sru_loop()
+static void arm_accept(sru_thread_t *t)
+{
+	struct io_uring_sqe *sqe = sru_sqe(t);
+
+	if(!sqe) { return; }
+	io_uring_prep_multishot_accept(sqe, t->e->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	io_uring_sqe_set_data64(sqe, SRU_OP_ACCEPT);
+	t->accepting = 1;
+}
+
+// return 0 on success, the connection must be closed otherwise
+static int arm_recv(sru_thread_t *t, sru_conn_t *c)
+{
+	struct io_uring_sqe *sqe = sru_sqe(t);
+
+	if(!sqe) { return 1; }
+	io_uring_prep_recv_multishot(sqe, c->fd, NULL, 0, 0);
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = SRU_BUF_GROUP;
+	io_uring_sqe_set_data64(sqe, (uint64_t)(uintptr_t)c | SRU_OP_RECV);
+	c->recving = 1;
+
+	return 0;
+}
+
+// return 0 on success, the connection must be closed otherwise
+static int arm_send(sru_thread_t *t, sru_conn_t *c)
+{
+	struct io_uring_sqe *sqe = sru_sqe(t);
+
+	if(!sqe) { return 1; }
+	io_uring_prep_sendmsg(sqe, c->fd, &c->msg, MSG_NOSIGNAL);
+	io_uring_sqe_set_data64(sqe, (uint64_t)(uintptr_t)c | SRU_OP_SEND);
+	c->sending = 1;
+
+	return 0;
+}
+
+static void arm_tick(sru_thread_t *t)
+{
+	struct io_uring_sqe *sqe = sru_sqe(t);
+
+	if(!sqe) { return; }
+	io_uring_prep_timeout(sqe, &t->tick, 0, 0);
+	io_uring_sqe_set_data64(sqe, SRU_OP_TICK);
+	t->ticking = 1;
+}
+
+// return 0 on success
+static int arm_wake(sru_thread_t *t)
+{
+	struct io_uring_sqe *sqe = sru_sqe(t);
+
+	if(!sqe) { return 1; }
+	io_uring_prep_read(sqe, t->wakefd, &t->wakeval, sizeof(t->wakeval), 0);
+	io_uring_sqe_set_data64(sqe, SRU_OP_WAKE);
+
+	return 0;
+}
+
+// Give a recv buffer back to the kernel
+static inline void buf_recycle(sru_thread_t *t, int bid)
+{
+	io_uring_buf_ring_add(t->br, t->bufs + (bid * SRU_BUF_SIZE), SRU_BUF_SIZE, bid, io_uring_buf_ring_mask(SRU_BUF_COUNT), 0);
+	io_uring_buf_ring_advance(t->br, 1);
+}
+
+static void conn_free(sru_thread_t *t, sru_conn_t *c)
+{
+	if(c->active) { searest_request_done(&c->ri); }
+	close(c->fd);
+
+	if(c->prev) { c->prev->next = c->next; }
+	else { t->conns = c->next; }
+	if(c->next) { c->next->prev = c->prev; }
+
+	__sync_fetch_and_sub(&t->e->conncount, 1);
+	free(c);
+}
+
+// Free the connection once the kernel is done with it
+static void conn_release(sru_thread_t *t, sru_conn_t *c)
+{
+	if(c->recving || c->sending) { return; }
+	conn_free(t, c);
+}
+
+// shutdown() completes our outstanding recv/send, conn_release() frees the connection after them
+static void conn_close(sru_thread_t *t, sru_conn_t *c)
+{
+	if(c->state == SRU_CLOSING) { return; }
+	c->state = SRU_CLOSING;
+	shutdown(c->fd, SHUT_RDWR);
+	conn_release(t, c);
+}
+
+static void conn_new(sru_thread_t *t, int fd)
+{
+	sri_t *ws = t->e->ws;
+	sru_conn_t *c;
+	struct sockaddr_storage ss;
+	socklen_t sslen = sizeof(ss);
+
+	if(__sync_add_and_fetch(&t->e->conncount, 1) > ws->conn_limit) {
+		__sync_fetch_and_sub(&t->e->conncount, 1);
+		close(fd);
+		return;
+	}
+
+	c = calloc(1, sizeof(sru_conn_t));
+	if(!c) {
+		__sync_fetch_and_sub(&t->e->conncount, 1);
+		close(fd);
+		return;
+	}
+	c->fd = fd;
+	c->last_active = time(NULL);
+
+	c->next = t->conns;
+	if(t->conns) { t->conns->prev = c; }
+	t->conns = c;
+
+	if(getpeername(fd, (struct sockaddr *)&ss, &sslen) == 0) {
+		if(searest_sockaddr_str((struct sockaddr *)&ss, c->ip, sizeof(c->ip))) { c->ip[0] = 0; }
+		// Only local processes can reach a unix socket, there is no address to check
+		if(ws->addr_cb && (ss.ss_family != AF_UNIX) && (ws->addr_cb(c->ip, ws->sri_user_data) != SR_IP_ACCEPT)) {
+			conn_free(t, c);
+			return;
+		}
+	}
+
+	if(arm_recv(t, c)) { conn_free(t, c); }
+}
+
+// Queue the response to the current request
+// The body is sent straight from the page or the return data, only the head is formatted
+static void send_response(sru_thread_t *t, sru_conn_t *c, char *page)
+{
+	int i, n;
+	const char *reason;
+	srci_t *ri = &c->ri;
+	const void *body;
+	size_t len;
+
+	if(ri->return_code == 0) { ri->return_code = MHD_HTTP_OK; }
+	if(ri->return_data) { body = ri->return_data; len = ri->return_data_len; }
+	else { body = page; len = page ? strlen(page) : 0; }
+	if(ri->head_length_set && (ri->method_type == METHOD_HEAD)) { len = ri->head_length; }
+
+	reason = MHD_get_reason_phrase_for(ri->return_code);
+	n = snprintf(c->out, sizeof(c->out), "HTTP/1.1 %d %s\r\nContent-Length: %zu\r\n",
+		ri->return_code, reason ? reason : "", len);
+	if(ri->content_type) { n += snprintf(c->out+n, sizeof(c->out)-n, "%s: %s\r\n", HDRCTSTR, ri->content_type); }
+	if(ri->allow && (n < sizeof(c->out))) { n += snprintf(c->out+n, sizeof(c->out)-n, "Allow: %s\r\n", ri->allow); }
+	if(ri->cors && (n < sizeof(c->out))) { n += snprintf(c->out+n, sizeof(c->out)-n, "Access-Control-Allow-Origin: *\r\n"); }
+	for(i=0; (i<ri->hdr_count) && (n < sizeof(c->out)); i++) {
+		n += snprintf(c->out+n, sizeof(c->out)-n, "%s: %s\r\n", ri->hdr_names[i], ri->hdr_values[i]);
+	}
+	if(!c->keepalive && (n < sizeof(c->out))) { n += snprintf(c->out+n, sizeof(c->out)-n, "Connection: close\r\n"); }
+	if(n < sizeof(c->out)) { n += snprintf(c->out+n, sizeof(c->out)-n, "\r\n"); }
+	if(n >= sizeof(c->out)) { conn_close(t, c); return; }
+
+	c->iov[0].iov_base = c->out;
+	c->iov[0].iov_len = n;
+	c->iov[1].iov_base = (void *)body;
+	c->iov[1].iov_len = len;
+	memset(&c->msg, 0, sizeof(c->msg));
+	c->msg.msg_iov = c->iov;
+	c->msg.msg_iovlen = (ri->method_type == METHOD_HEAD) ? 1 : 2;
+
+	c->state = SRU_SEND;
+	if(arm_send(t, c)) { conn_close(t, c); }
+}
+
+static void send_continue(sru_thread_t *t, sru_conn_t *c)
+{
+	static const char cont[] = "HTTP/1.1 100 Continue\r\n\r\n";
+
+	c->iov[0].iov_base = (void *)cont;
+	c->iov[0].iov_len = sizeof(cont)-1;
+	memset(&c->msg, 0, sizeof(c->msg));
+	c->msg.msg_iov = c->iov;
+	c->msg.msg_iovlen = 1;
+
+	c->interim = 1;
+	if(arm_send(t, c)) { conn_close(t, c); }
+}
+
+// Responses are sent from memory, so a reader is drained up front
+// return 0 on success
+static int drain_reader(srci_t *ri)
+{
+	ssize_t z;
+	uint64_t pos = 0;
+	char *buf;
+
+	buf = malloc(ri->reader_size ? ri->reader_size : 1);
+	if(!buf) { return 1; }
+
+	while(pos < ri->reader_size) {
+		z = ri->reader(ri->reader_cls, pos, buf+pos, ri->reader_size-pos);
+		if(z <= 0) {
+			free(buf);
+			return 1;
+		}
+		pos += z;
+	}
+
+	srci_set_return_data(ri, buf, ri->reader_size, &free, buf);
+	return 0;
+}
+
+static void finish_request(sru_thread_t *t, sru_conn_t *c)
+{
+	char *page;
+	srci_t *ri = &c->ri;
+
+	page = searest_request_process(t->e->ws, ri, t->e->sri_user_data);
+
+	if(!page && ri->reader && drain_reader(ri)) {
+		ri->return_code = MHD_HTTP_INTERNAL_SERVER_ERROR;
+		page = ri->return_page = strdup("internal server error");
+		c->keepalive = 0;
+		if(!page) { conn_close(t, c); return; }
+	}
+
+	// srci_suspend() needs the libmicrohttpd engine
+	if(!page && !ri->return_data) {
+		ri->return_code = MHD_HTTP_INTERNAL_SERVER_ERROR;
+		page = ri->return_page = strdup("deferred responses are not supported");
+		c->keepalive = 0;
+		if(!page) { conn_close(t, c); return; }
+	}
+
+	send_response(t, c, page);
+}
+
+// Hand request body bytes to searest, anything past the body belongs to the next request
+// return the number of bytes used
+static size_t feed_body(sru_thread_t *t, sru_conn_t *c, const char *data, size_t len)
+{
+	size_t take = (len < c->body_left) ? len : c->body_left;
+
+	if(take && searest_request_upload(t->e->ws, &c->ri, data, take)) {
+		conn_close(t, c);
+		return len;
+	}
+	c->body_left -= take;
+	if(c->body_left == 0) { finish_request(t, c); }
+
+	return take;
+}
+
+static void drop_input(sru_conn_t *c, size_t len)
+{
+	memmove(c->in, c->in+len, c->inlen-len);
+	c->inlen -= len;
+}
+
+// Split "Name: value" and return the value, NULL if the line has no colon
+static char* header_value(char *line)
+{
+	char *v = strchr(line, ':');
+
+	if(!v) { return NULL; }
+	*v++ = 0;
+	while((*v == ' ') || (*v == '\t')) { v++; }
+
+	return v;
+}
+
+// Parse the request head once all of it is in c->in, and start the request
+static void try_head(sru_thread_t *t, sru_conn_t *c)
+{
+	int expect = 0;
+	size_t headlen;
+	char *end, *line, *next, *v, *method, *url, *version;
+	char *accept = NULL, *auth = NULL, *cl = NULL, *te = NULL, *range = NULL;
+	sri_t *ws = t->e->ws;
+	srci_t *ri = &c->ri;
+	char *page;
+
+	if(c->inlen == 0) { return; }
+	end = memmem(c->in, c->inlen, "\r\n\r\n", 4);
+	if(!end) {
+		if(c->inlen == sizeof(c->in)) { conn_close(t, c); }
+		return;
+	}
+	headlen = (end - c->in) + 4;
+	*end = 0;
+
+	// Request Line
+	method = c->in;
+	next = strstr(method, "\r\n");
+	if(next) { *next = 0; next += 2; }
+	url = strchr(method, ' ');
+	if(!url) { conn_close(t, c); return; }
+	*url++ = 0;
+	version = strchr(url, ' ');
+	if(!version) { conn_close(t, c); return; }
+	*version++ = 0;
+	v = strchr(url, '?');
+	if(v) { *v = 0; }
+	c->keepalive = (strcmp(version, "HTTP/1.1") == 0);
+
+	// Headers
+	for(line=next; line && *line; line=next) {
+		next = strstr(line, "\r\n");
+		if(next) { *next = 0; next += 2; }
+		v = header_value(line);
+		if(!v) { continue; }
+		if(strcasecmp(line, HDRASTR) == 0) { accept = v; }
+		else if(strcasecmp(line, HDRAUTHSTR) == 0) { auth = v; }
+		else if(strcasecmp(line, HDRCLSTR) == 0) { cl = v; }
+		else if(strcasecmp(line, HDRTESTR) == 0) { te = v; }
+		else if(strcasecmp(line, HDRRANGESTR) == 0) { range = v; }
+		else if(strcasecmp(line, "Expect") == 0) { expect = (strcasecmp(v, "100-continue") == 0); }
+		else if(strcasecmp(line, "Connection") == 0) {
+			if(strcasecmp(v, "close") == 0) { c->keepalive = 0; }
+			if(strcasecmp(v, "keep-alive") == 0) { c->keepalive = 1; }
+		}
+	}
+
+	c->active = 1;
+	if(searest_request_init(ws, ri, &c->arena, url, method, accept, auth, cl, te, range)) {
+		conn_close(t, c);
+		return;
+	}
+	if(c->ip[0]) { ri->ip = c->ip; }
+	drop_input(c, headlen);
+
+	if(ri->chunked) {
+		ri->return_code = MHD_HTTP_NOT_IMPLEMENTED;
+		ri->return_page = strdup("chunked uploads are not supported");
+		c->keepalive = 0;
+		if(!ri->return_page) { conn_close(t, c); return; }
+		send_response(t, c, ri->return_page);
+		return;
+	}
+
+	// Ask the node if the upload is ok before the client sends it
+	page = searest_request_precheck(ws, ri, t->e->sri_user_data);
+	if(page) {
+		ri->rejected = 1;
+		c->keepalive = 0;
+		send_response(t, c, page);
+		return;
+	}
+
+	c->body_left = ri->content_length;
+	if(c->body_left == 0) { finish_request(t, c); return; }
+
+	c->state = SRU_BODY;
+	if(expect && (c->inlen == 0)) { send_continue(t, c); }
+	else if(c->inlen) { drop_input(c, feed_body(t, c, c->in, c->inlen)); }
+}
+
+static void on_data(sru_thread_t *t, sru_conn_t *c, const char *data, size_t len)
+{
+	size_t used;
+
+	c->last_active = time(NULL);
+
+	switch(c->state) {
+		case SRU_BODY:
+			used = feed_body(t, c, data, len);
+			data += used;
+			len -= used;
+			if(c->state == SRU_CLOSING) { return; }
+			break;
+		case SRU_SEND:
+			// This connection closes after the response, nothing else will be read
+			if(!c->keepalive) { return; }
+			break;
+		case SRU_CLOSING:
+			return;
+	}
+	if(len == 0) { return; }
+
+	// Keep the rest for the next request head (pipelining)
+	if(len > sizeof(c->in) - c->inlen) { conn_close(t, c); return; }
+	memcpy(c->in + c->inlen, data, len);
+	c->inlen += len;
+	if(c->state == SRU_HEAD) { try_head(t, c); }
+}
+
+static void on_send(sru_thread_t *t, sru_conn_t *c, int res)
+{
+	size_t sent;
+	struct iovec *iov;
+
+	c->sending = 0;
+	if(c->state == SRU_CLOSING) { conn_release(t, c); return; }
+	if(res < 0) { conn_close(t, c); return; }
+
+	// A slow client that is still taking the response is not idle
+	c->last_active = time(NULL);
+
+	// A short send, queue the rest
+	sent = res;
+	while((c->msg.msg_iovlen > 0) && (sent >= c->msg.msg_iov[0].iov_len)) {
+		sent -= c->msg.msg_iov[0].iov_len;
+		c->msg.msg_iov++;
+		c->msg.msg_iovlen--;
+	}
+	if(c->msg.msg_iovlen > 0) {
+		iov = c->msg.msg_iov;
+		iov->iov_base = (char *)iov->iov_base + sent;
+		iov->iov_len -= sent;
+		if(arm_send(t, c)) { conn_close(t, c); }
+		return;
+	}
+
+	// 100 Continue is out, the body is on its way
+	if(c->interim) { c->interim = 0; return; }
+
+	searest_request_done(&c->ri);
+	c->active = 0;
+	if(!c->keepalive) { conn_close(t, c); return; }
+
+	c->state = SRU_HEAD;
+	try_head(t, c);
+}
+
+// Close connections that have been idle for longer than the inactivity timeout
+static void on_tick(sru_thread_t *t)
+{
+	time_t now = time(NULL);
+	int timeout = t->e->ws->inactivity_timeout;
+	sru_conn_t *c, *next;
+
+	if(timeout <= 0) { return; }
+	for(c=t->conns; c; c=next) {
+		next = c->next;
+		if(c->state == SRU_CLOSING) { continue; }
+		if(now - c->last_active > timeout) { conn_close(t, c); }
+	}
+}
+
+static void on_completion(sru_thread_t *t, struct io_uring_cqe *cqe)
+{
+	int bid;
+	uint64_t ud = io_uring_cqe_get_data64(cqe);
+	sru_conn_t *c = (sru_conn_t *)(uintptr_t)(ud & ~(uint64_t)SRU_OP_MASK);
+	int more = (cqe->flags & IORING_CQE_F_MORE);
+	int res = cqe->res;
+
+	switch(ud & SRU_OP_MASK) {
+		case SRU_OP_ACCEPT:
+			if(res >= 0) { conn_new(t, res); }
+			if(!more) { t->accepting = 0; }		// sru_loop() arms it again
+			break;
+		case SRU_OP_RECV:
+			if((res > 0) && (cqe->flags & IORING_CQE_F_BUFFER)) {
+				bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+				on_data(t, c, t->bufs + (bid * SRU_BUF_SIZE), res);
+				buf_recycle(t, bid);
+			}
+			if(more) { break; }
+			c->recving = 0;
+			if(c->state == SRU_CLOSING) { conn_release(t, c); }
+			else if((res > 0) || (res == -ENOBUFS)) {
+				if(arm_recv(t, c)) { conn_close(t, c); }
+			}
+			else if((res == 0) && (c->state == SRU_SEND)) { c->keepalive = 0; }	// a half-close, the response is still sent
+			else { conn_close(t, c); }	// the client went away
+			break;
+		case SRU_OP_SEND:
+			on_send(t, c, res);
+			break;
+		case SRU_OP_TICK:
+			on_tick(t);
+			t->ticking = 0;		// sru_loop() arms it again
+			break;
+		case SRU_OP_WAKE:
+			t->stop = 1;
+			break;
+	}
+}
+
+static void* sru_loop(void *arg)
+{
+	int z;
+	unsigned head, n;
+	struct io_uring_cqe *cqe;
+	sru_thread_t *t = arg;
+
+	if(arm_wake(t)) { return NULL; }
+
+	while(!t->stop) {
+		// Keep the accept and the tick armed, even if a full submission queue kept them out before
+		if(!t->accepting) { arm_accept(t); }
+		if(!t->ticking) { arm_tick(t); }
+
+		// Everything queued while handling the last batch goes out in one syscall
+		z = io_uring_submit_and_wait(&t->ring, 1);
+		if(z == -EINTR) { continue; }
+		n = 0;
+		io_uring_for_each_cqe(&t->ring, head, cqe) {
+			on_completion(t, cqe);
+			n++;
+		}
+		io_uring_cq_advance(&t->ring, n);
+	}
+
+	return NULL;
+}
+
+static void sru_thread_free(sru_thread_t *t)
+{
+	sru_conn_t *c;
+
+	while((c = t->conns)) { conn_free(t, c); }
+	if(t->br) { io_uring_free_buf_ring(&t->ring, t->br, SRU_BUF_COUNT, SRU_BUF_GROUP); }
+	if(t->ringed) { io_uring_queue_exit(&t->ring); }
+	if(t->bufs) { free(t->bufs); }
+	if(t->wakefd >= 0) { close(t->wakefd); }
+}
+
+static int sru_thread_init(sru_t *e, sru_thread_t *t)
+{
+	int i, err;
+
+	t->e = e;
+	t->wakefd = -1;
+	t->tick.tv_sec = 1;
+
+	if(io_uring_queue_init(SRU_QUEUE_DEPTH, &t->ring, 0) < 0) { return 1; }
+	t->ringed = 1;
+
+	t->wakefd = eventfd(0, EFD_CLOEXEC);
+	if(t->wakefd < 0) { return 2; }
+
+	t->bufs = malloc(SRU_BUF_COUNT * SRU_BUF_SIZE);
+	if(!t->bufs) { return 3; }
+	t->br = io_uring_setup_buf_ring(&t->ring, SRU_BUF_COUNT, SRU_BUF_GROUP, 0, &err);
+	if(!t->br) { return 4; }
+	for(i=0; i<SRU_BUF_COUNT; i++) {
+		io_uring_buf_ring_add(t->br, t->bufs + (i * SRU_BUF_SIZE), SRU_BUF_SIZE, i, io_uring_buf_ring_mask(SRU_BUF_COUNT), i);
+	}
+	io_uring_buf_ring_advance(t->br, SRU_BUF_COUNT);
+
+	if(pthread_create(&t->thread, NULL, &sru_loop, t) != 0) { return 5; }
+
+	return 0;
+}
+
+void sru_stop(void *engine)
+{
+	int i;
+	uint64_t one = 1;
+	sru_t *e = engine;
+
+	for(i=0; i<e->count; i++) {
+		if(write(e->threads[i].wakefd, &one, sizeof(one)) < 0) { continue; }
+		pthread_join(e->threads[i].thread, NULL);
+	}
+	for(i=0; i<e->count; i++) { sru_thread_free(&e->threads[i]); }
+	free(e->threads);
+	free(e);
+}
+
+// Serve listen_fd with one ring per thread of the thread pool
+// return NULL on failure
+void* sru_start(sri_t *ws, int listen_fd, void *sri_user_data)
+{
+	int i;
+	sru_t *e;
+
+	e = calloc(1, sizeof(sru_t));
+	if(!e) { return NULL; }
+	e->ws = ws;
+	e->sri_user_data = sri_user_data;
+	e->listen_fd = listen_fd;
+
+	e->count = (ws->thread_pool_size > 1) ? ws->thread_pool_size : 1;
+	e->threads = calloc(e->count, sizeof(sru_thread_t));
+	if(!e->threads) { free(e); return NULL; }
+
+	for(i=0; i<e->count; i++) {
+		if(sru_thread_init(e, &e->threads[i])) {
+			// Only the threads that started are stopped, the rest are torn down here
+			sru_thread_free(&e->threads[i]);
+			e->count = i;
+			sru_stop(e);
+			return NULL;
+		}
+	}
+
+	return e;
+}
+
+#endif
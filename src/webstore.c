@@ -28,22 +28,25 @@
 
 static void parse_args(int argc, char **argv);
 
-int g_redis_error = 0;
 int g_shutdown = 0;
 
-char *g_rsock = NULL;
-char *g_rip = NULL;
-unsigned short g_rport = 0;
-
 srv_opts_t g_so;
 char *g_logfile = NULL;
 
 int shutting_down(void) { return g_shutdown; }
 
+// A failed context is reconnected the next time it is checked out
+// Until then it is kept (and fails every command), so a failure is only logged once per lost connection
 #include <errno.h>
 void handle_redis_error(rai_t *rc)
 {
 	char *etype = NULL;
+
+	if(rc->c->err) {
+		if(rc->reported) { return; }
+		rc->reported = 1;
+	}
+
 	switch(rc->c->err) {
 		case REDIS_ERR_IO:
 			fprintf(stderr, "REDIS_ERR_IO: %s\n", strerror(errno));
@@ -68,8 +71,14 @@ void handle_redis_error(rai_t *rc)
 		fprintf(stderr, "%s: %s\n", etype, rc->c->errstr);
 		log_add(WSLOG_ERR, "%s: %s", etype, rc->c->errstr);
 	}
-	g_redis_error = 1;
-	g_shutdown = 1;
+}
+
+// Called from the async event loop thread when the connection drops
+// The event loop will reconnect on its own
+void handle_redis_async_error(const char *errstr)
+{
+	fprintf(stderr, "REDIS_ASYNC: %s\n", errstr);
+	log_add(WSLOG_ERR, "REDIS_ASYNC: %s", errstr);
 }
 
 #ifdef SRNODECHRONOMETRY
@@ -112,6 +121,9 @@ int main(int argc, char *argv[])
 
 	memset(&g_so, 0, sizeof(srv_opts_t));
 	g_so.max_post_data_size = (20*1024*1024);
+	g_so.rpool = 1;
+	g_so.rbatch = 32;
+	g_so.rbreaker = 5;
 	parse_args(argc, argv);
 
 	if(g_logfile) {
@@ -122,12 +134,9 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if(g_rsock) {
-		g_so.rdest = g_rsock;
-		webstore_start(&g_so);
-	} else if(g_rip && (g_rport > 0)) {
-		g_so.rdest = g_rip;
-		g_so.rport = g_rport;
+	if(g_so.rcount > 0) {
+		g_so.rdest = g_so.rdests[0];
+		g_so.rport = g_so.rports[0];
 		webstore_start(&g_so);
 	} else {
 		fprintf(stderr, "webstore_start() failed!\n");
@@ -143,7 +152,7 @@ int main(int argc, char *argv[])
 	(void) alarm(1);
 
 	z=0;	// Wait for the sweet release of death
-	while(!g_shutdown && !g_redis_error) {
+	while(!g_shutdown) {
 		if(z>999) { z=0; }
 		usleep(1000);
 		z++;
@@ -156,8 +165,9 @@ int main(int argc, char *argv[])
 
 	// Unnecessary Clean Up
 	if(g_logfile) { free(g_logfile); }
-	if(g_rsock) { free(g_rsock); }
-	if(g_rip) { free(g_rip); }
+	for(z=0; z<g_so.rcount; z++) { free(g_so.rdests[z]); }
+	for(z=0; z<g_so.rrcount; z++) { free(g_so.rrdests[z]); }
+	for(z=0; z<g_so.lcount; z++) { free(g_so.ldests[z]); }
 	if(g_so.http_ip) { free(g_so.http_ip); }
 	if(g_so.certfile) { free(g_so.certfile); }
 	if(g_so.keyfile) { free(g_so.keyfile); }
@@ -178,9 +188,89 @@ struct options opts[] =
 #ifdef SRNODECHRONOMETRY
 	{ 10, "stats",	"Show stats every second",		NULL, 0 },
 #endif
+	{ 11, "rpool",	"Redis connection pool size",	NULL, 1 },
+	{ 12, "async",	"Non-blocking redis requests",	NULL, 0 },
+	{ 13, "rwindow",	"Redis batch window (usec)",	NULL, 1 },
+	{ 14, "rbatch",	"Redis batch max commands",		NULL, 1 },
+	{ 15, "rcluster",	"Redis tcp address is a cluster",	NULL, 0 },
+	{ 16, "rreplica",	"Send GETs to this Redis replica",	NULL, 1 },
+	{ 17, "rread",	"Replica selection (rr/lo)",	NULL, 1 },
+	{ 18, "rryw",	"Retry replica misses on primary",	NULL, 0 },
+	{ 19, "rtimeout",	"Redis command timeout (ms)",	NULL, 1 },
+	{ 20, "rbreaker",	"Redis failures before failing fast",	NULL, 1 },
+	{ 21, "tpool",	"UHD epoll thread pool size",	NULL, 1 },
+	{ 22, "daemons",	"UHD daemons sharing the port",	NULL, 1 },
+	{ 23, "stream",	"Validate uploads as they arrive",	NULL, 0 },
+	{ 24, "sfwd",	"Stream uploads straight to redis",	NULL, 0 },
+	{ 25, "listen",	"Also listen on IP:PORT, [IPv6]:PORT or a unix socket",	NULL, 1 },
+	{ 26, "uring",	"Serve HTTP with io_uring",		NULL, 0 },
+	{ 27, "sget",	"Stream GET responses from redis in windows of N bytes",	NULL, 1 },
 	{ 0, NULL,		NULL,							NULL, 0 }
 };
 
+static void add_redis(char *dest, unsigned short port)
+{
+	if(g_so.rcount >= RAIS_MAX_SHARDS) {
+		fprintf(stderr, "Too many redis instances! (max: %d)\n", RAIS_MAX_SHARDS);
+		exit(EXIT_FAILURE);
+	}
+
+	g_so.rdests[g_so.rcount] = strdup(dest);
+	g_so.rports[g_so.rcount] = port;
+	g_so.rcount++;
+}
+
+// IP:PORT, [IPv6]:PORT or a unix socket path
+static void add_listener(char *addr)
+{
+	char *colon, *dest = addr;
+
+	if(g_so.lcount >= WS_MAX_LISTENERS) {
+		fprintf(stderr, "Too many listeners! (max: %d)\n", WS_MAX_LISTENERS);
+		exit(EXIT_FAILURE);
+	}
+
+	if(addr[0] != '/') {
+		colon = strrchr(addr, ':');
+		if(addr[0] == '[') {
+			dest = addr+1;
+			if(!colon || (colon == addr) || (colon[-1] != ']')) { colon = NULL; }
+			else { colon[-1] = 0; }
+		}
+		if(!colon || (atoi(colon+1) <= 0)) {
+			fprintf(stderr, "Invalid listener! (Fix with --listen IP:PORT, [IPv6]:PORT or /path/to.sock)\n");
+			exit(EXIT_FAILURE);
+		}
+		*colon = 0;
+		g_so.lports[g_so.lcount] = atoi(colon+1);
+	}
+	g_so.ldests[g_so.lcount] = strdup(dest);
+	g_so.lcount++;
+}
+
+// IP:PORT or a file socket
+static void add_replica(char *addr)
+{
+	char *colon;
+
+	if(g_so.rrcount >= RAIR_MAX_REPLICAS) {
+		fprintf(stderr, "Too many redis replicas! (max: %d)\n", RAIR_MAX_REPLICAS);
+		exit(EXIT_FAILURE);
+	}
+
+	colon = strrchr(addr, ':');
+	if(colon) {
+		if(atoi(colon+1) <= 0) {
+			fprintf(stderr, "Invalid redis replica port! (Fix with --rreplica IP:PORT)\n");
+			exit(EXIT_FAILURE);
+		}
+		*colon = 0;
+		g_so.rrports[g_so.rrcount] = atoi(colon+1);
+	}
+	g_so.rrdests[g_so.rrcount] = strdup(addr);
+	g_so.rrcount++;
+}
+
 static void parse_args(int argc, char **argv)
 {
 	char *args, *colon;
@@ -210,15 +300,16 @@ static void parse_args(int argc, char **argv)
 				g_logfile = strdup(args);
 				break;
 			case 5:
-				g_rsock = strdup(args);
+				add_redis(args, 0);
 				break;
 			case 6:
 				colon = strchr(args, ':');
-				if(colon) {
-					*colon = 0;
-					g_rip = strdup(args);
-					g_rport = atoi(colon+1);
+				if(!colon || (atoi(colon+1) <= 0)) {
+					fprintf(stderr, "Invalid redis tcp port! (Fix with --rtcp IP:PORT)\n");
+					exit(EXIT_FAILURE);
 				}
+				*colon = 0;
+				add_redis(args, atoi(colon+1));
 				break;
 			case 7:
 				g_so.certfile = strdup(args);
@@ -234,6 +325,63 @@ static void parse_args(int argc, char **argv)
 				g_alarm_stats = 1;
 				break;
 #endif
+			case 11:
+				g_so.rpool = atoi(args);
+				break;
+			case 12:
+				g_so.use_async = 1;
+				break;
+			case 13:
+				g_so.rwindow = atol(args);
+				break;
+			case 14:
+				g_so.rbatch = atoi(args);
+				break;
+			case 15:
+				g_so.use_cluster = 1;
+				break;
+			case 16:
+				add_replica(args);
+				break;
+			case 17:
+				if(strcmp(args, "rr") == 0) { g_so.rrpolicy = RAIR_ROUND_ROBIN; }
+				else if(strcmp(args, "lo") == 0) { g_so.rrpolicy = RAIR_LEAST_OUTSTANDING; }
+				else {
+					fprintf(stderr, "Unknown replica selection: %s! (Fix with --rread rr/lo)\n", args);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 18:
+				g_so.rryw = 1;
+				break;
+			case 19:
+				g_so.rtimeout = atol(args);
+				break;
+			case 20:
+				g_so.rbreaker = atoi(args);
+				break;
+			case 21:
+				g_so.tpool = atoi(args);
+				break;
+			case 22:
+				g_so.daemons = atoi(args);
+				break;
+			case 23:
+				g_so.stream = 1;
+				break;
+			case 24:
+				g_so.stream = 1;
+				g_so.sfwd = 1;
+				break;
+			case 25:
+				add_listener(args);
+				break;
+			case 26:
+				g_so.uring = 1;
+				break;
+			case 27:
+				g_so.sget = atol(args);
+				break;
 			default:
 				fprintf(stderr, "Unexpected getopts Error! (%d)\n", c);
 				break;
@@ -243,16 +391,11 @@ static void parse_args(int argc, char **argv)
 		free(args);
 	}
 
-	if(!g_rsock && !g_rip) {
+	if(g_so.rcount < 1) {
 		fprintf(stderr, "I need to connect to redis! (Fix with --rsock/--rtcp)\n");
 		exit(EXIT_FAILURE);
 	}
 
-	if(g_rip && !g_rport) {
-		fprintf(stderr, "Invalid redis tcp port! (Fix with --rsock IP:PORT)\n");
-		exit(EXIT_FAILURE);
-	}
-
 	if(!g_so.http_port) {
 		fprintf(stderr, "I need a port to listen on! (Fix with -P)\n");
 		exit(EXIT_FAILURE);
@@ -272,4 +415,134 @@ static void parse_args(int argc, char **argv)
 		fprintf(stderr, "POST data size limit is too small! (Fix with --dsize)\n");
 		exit(EXIT_FAILURE);
 	}
+
+	if(g_so.rpool < 1) {
+		fprintf(stderr, "Redis pool size must be at least 1! (Fix with --rpool)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if(g_so.tpool < 0) {
+		fprintf(stderr, "Invalid thread pool size! (Fix with --tpool)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if((g_so.daemons < 0) || (g_so.daemons > WS_MAX_DAEMONS)) {
+		fprintf(stderr, "Invalid daemon count (max: %d)! (Fix with --daemons)\n", WS_MAX_DAEMONS);
+		exit(EXIT_FAILURE);
+	}
+
+	if(g_so.tpool && g_so.use_threads) {
+		fprintf(stderr, "Choose a thread per connection or a thread pool! (Fix by removing -t or --tpool)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if(g_so.use_async && g_so.use_threads) {
+		fprintf(stderr, "Async redis requires the single threaded server! (Fix by removing -t)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if(g_so.rwindow < 0) {
+		fprintf(stderr, "Invalid redis batch window! (Fix with --rwindow)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if(g_so.rwindow && !g_so.use_threads && (g_so.tpool < 2)) {
+		fprintf(stderr, "Redis batching requires the multithreaded server! (Fix with -t or --tpool)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if(g_so.use_cluster && ((g_so.rcount != 1) || !g_so.rports[0])) {
+		fprintf(stderr, "Redis cluster requires exactly one tcp seed node! (Fix with --rtcp IP:PORT)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if(g_so.uring && g_so.use_threads) {
+		fprintf(stderr, "The io_uring engine uses a thread pool! (Fix by removing -t, size it with --tpool)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if(g_so.uring && g_so.use_async) {
+		fprintf(stderr, "The io_uring engine does not support async redis! (Fix by removing --async)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if(g_so.uring && g_so.certfile) {
+		fprintf(stderr, "The io_uring engine does not support HTTPS! (Fix by removing --uring)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if(g_so.sget && (g_so.sget < 4096)) {
+		fprintf(stderr, "Invalid GET window size! (Fix with --sget 4096 or larger)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if(g_so.sget && g_so.use_async) {
+		fprintf(stderr, "Streaming from redis requires blocking redis requests! (Fix by removing --async)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if(g_so.sget && !g_so.use_threads && (g_so.tpool < 2)) {
+		fprintf(stderr, "Streaming from redis requires the multithreaded server! (Fix with -t or --tpool)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if(g_so.sget && g_so.rwindow) {
+		fprintf(stderr, "Streaming from redis does not support redis batching! (Fix by removing --rwindow)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if(g_so.sfwd && g_so.use_async) {
+		fprintf(stderr, "Streaming to redis requires blocking redis requests! (Fix by removing --async)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if(g_so.sfwd && g_so.rwindow) {
+		fprintf(stderr, "Streaming to redis does not support redis batching! (Fix by removing --rwindow)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if(g_so.use_cluster && g_so.use_async) {
+		fprintf(stderr, "Async redis does not support redis cluster! (Fix by removing --async)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if(g_so.use_cluster && g_so.rwindow) {
+		fprintf(stderr, "Redis batching does not support redis cluster! (Fix by removing --rwindow)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if((g_so.rcount > 1) && g_so.use_async) {
+		fprintf(stderr, "Async redis does not support sharding! (Fix by using one --rsock/--rtcp)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if((g_so.rcount > 1) && g_so.rwindow) {
+		fprintf(stderr, "Redis batching does not support sharding! (Fix by removing --rwindow)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if(g_so.rrcount && (g_so.use_cluster || (g_so.rcount > 1))) {
+		fprintf(stderr, "Read replicas require a single primary! (Fix by removing --rcluster or extra --rsock/--rtcp)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if(g_so.rrcount && g_so.use_async) {
+		fprintf(stderr, "Async redis does not support read replicas! (Fix by removing --async)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if(g_so.rtimeout < 0) {
+		fprintf(stderr, "Invalid redis timeout! (Fix with --rtimeout)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if(g_so.rbreaker < 0) {
+		fprintf(stderr, "Invalid redis breaker threshold! (Fix with --rbreaker)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if(g_so.rbatch < 1) {
+		fprintf(stderr, "Redis batch size must be at least 1! (Fix with --rbatch)\n");
+		exit(EXIT_FAILURE);
+	}
 }
@@ -0,0 +1,775 @@
+/*
+	webstore is a web-based arbitrary data storage service that accepts z85 encoded data 
+	Copyright (C) 2021 Brett Kuskie <fullaxx@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; version 2 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "webstore.h"
+#include "webstore_ops.h"
+#include "webstore_log.h"
+
+// /batch/get carries one token per line (any whitespace will do)
+// Each item of the response is framed as:
+// <token> <status> <length>\n<length bytes>\n
+// /batch/post carries one frame per object:
+// <token> <length>\n<length bytes>\n
+// Each item of the response is one line:
+// <token> <status>\n
+// /batch/exists carries the same token list as /batch/get
+// The response is a bitmap, bit i (MSB first) is set if token i exists
+#define WSBATCH_MAX (1000)
+#define WSBATCH_CT "application/x-webstore-batch"
+#define WSBATCH_BLOCK (32*1024)
+
+typedef struct {
+	char token[128+1];	// lowercase
+	int backend;
+	int status;			// 0 until the item is resolved
+	redisReply *val;	// owned by one of the batch replies
+	const unsigned char *data;	// points into the upload buffer
+	size_t len;
+} wsitem_t;
+
+// items grow with the request, up to WSBATCH_MAX
+typedef struct {
+	int count;
+	int size;
+	wsitem_t *items;
+	int rcount;
+	redisReply **replies;	// only /batch/get keeps replies, see batch_get()
+
+	// Where batch_reader() is in the framed response
+	uint64_t pos;
+	int cur;
+	size_t off;
+	char head[128+64];
+	size_t headlen;
+} wsbatch_t;
+
+// Lowercase a token in place
+// return 0 if it is a valid token for one of our store nodes
+static int batch_token(char *t)
+{
+	size_t i, len = strlen(t);
+
+	switch(len) {
+		case HASHLEN128:
+		case HASHLEN160:
+		case HASHLEN224:
+		case HASHLEN256:
+		case HASHLEN384:
+		case HASHLEN512:
+			break;
+		default:
+			return 1;
+	}
+
+	for(i=0; i<len; i++) {
+		if(!isxdigit(t[i])) { return 1; }
+		t[i] = tolower(t[i]);
+	}
+
+	return 0;
+}
+
+static wsbatch_t* batch_new(srci_t *ri)
+{
+	wsbatch_t *b;
+
+	if(srci_get_post_data_size(ri) == 0) {
+		srci_set_return_code(ri, MHD_HTTP_BAD_REQUEST);
+		return NULL;
+	}
+
+	b = calloc(1, sizeof(wsbatch_t));
+	if(!b) { srci_set_return_code(ri, MHD_HTTP_INTERNAL_SERVER_ERROR); }
+	return b;
+}
+
+static void batch_del(void *cls)
+{
+	wsbatch_t *b = cls;
+	int i;
+
+	for(i=0; i<b->rcount; i++) { freeReplyObject(b->replies[i]); }
+	free(b->replies);
+	free(b->items);
+	free(b);
+}
+
+// Add an item for the len characters at tok
+// return NULL if the batch is full
+static wsitem_t* batch_add(wsrt_t *rt, wsbatch_t *b, const char *tok, size_t len)
+{
+	int size;
+	wsitem_t *it;
+
+	if(b->count == WSBATCH_MAX) { return NULL; }
+	if(b->count == b->size) {
+		size = b->size ? (2 * b->size) : 16;
+		if(size > WSBATCH_MAX) { size = WSBATCH_MAX; }
+		it = realloc(b->items, size * sizeof(wsitem_t));
+		if(!it) { return NULL; }
+		memset(&it[b->size], 0, (size - b->size) * sizeof(wsitem_t));
+		b->items = it;
+		b->size = size;
+	}
+	it = &b->items[b->count++];
+
+	// An oversized token is echoed back truncated
+	if(len > 128) {
+		memcpy(it->token, tok, 128);
+		it->status = MHD_HTTP_BAD_REQUEST;
+		return it;
+	}
+
+	memcpy(it->token, tok, len);
+	if(batch_token(it->token)) { it->status = MHD_HTTP_BAD_REQUEST; }
+	else { it->backend = ws_redis_backend(rt, it->token); }
+	return it;
+}
+
+// Split the uploaded token list into items
+// return non-zero and set the return code if the list is not usable
+static int batch_tokens(wsrt_t *rt, wsbatch_t *b, srci_t *ri)
+{
+	const char *p = (const char *)srci_get_post_data_ptr(ri);
+	const char *end = p + srci_get_post_data_size(ri);
+	const char *tok;
+
+	while(p < end) {
+		if(isspace(*p)) { p++; continue; }
+		for(tok=p; (p < end) && !isspace(*p); p++) { ; }
+		if(!batch_add(rt, b, tok, p-tok)) {
+			srci_set_return_code(ri, MHD_HTTP_PAYLOAD_TOO_LARGE);
+			return 1;
+		}
+	}
+
+	if(b->count == 0) {
+		srci_set_return_code(ri, MHD_HTTP_BAD_REQUEST);
+		return 1;
+	}
+
+	return 0;
+}
+
+// Split the uploaded frames into items, payloads are not copied
+// return non-zero and set the return code if the frames are not usable
+static int batch_frames(wsrt_t *rt, wsbatch_t *b, srci_t *ri)
+{
+	const char *p = (const char *)srci_get_post_data_ptr(ri);
+	const char *end = p + srci_get_post_data_size(ri);
+	const char *nl, *sp;
+	char *e;
+	unsigned long len;
+	wsitem_t *it;
+
+	while(p < end) {
+		nl = memchr(p, '\n', end-p);
+		sp = nl ? memchr(p, ' ', nl-p) : NULL;
+		if(!sp) { break; }
+
+		len = strtoul(sp+1, &e, 10);
+		if((e != nl) || (sp+1 == nl)) { break; }
+		if((len >= end-(nl+1)) || (nl[1+len] != '\n')) { break; }
+
+		it = batch_add(rt, b, p, sp-p);
+		if(!it) {
+			srci_set_return_code(ri, MHD_HTTP_PAYLOAD_TOO_LARGE);
+			return 1;
+		}
+
+		it->data = (const unsigned char *)nl+1;
+		it->len = len;
+		if(!it->status && ((len < 5) || Z85_validate(it->data, len))) { it->status = MHD_HTTP_BAD_REQUEST; }
+		p = nl+1+len+1;
+	}
+
+	if((p < end) || (b->count == 0)) {
+		srci_set_return_code(ri, MHD_HTTP_BAD_REQUEST);
+		return 1;
+	}
+
+	return 0;
+}
+
+// Collect the unresolved items that live on the same backend as item i
+// return the number of keys in keys[] (their item index is in idx[])
+static int batch_group(wsbatch_t *b, int i, const char **keys, int *idx)
+{
+	int j, n = 0;
+
+	for(j=i; j<b->count; j++) {
+		if(b->items[j].status) { continue; }
+		if(b->items[j].backend != b->items[i].backend) { continue; }
+		keys[n] = b->items[j].token;
+		idx[n++] = j;
+	}
+
+	return n;
+}
+
+// Keep a reply until the response is built, set the status of every item in the group
+// return 0 if the reply is an array with one element per item
+static int batch_reply(wsbatch_t *b, redisReply *reply, int n, int *idx)
+{
+	int k, err = 0;
+
+	if(!reply) { err = 503; }
+	else if((reply->type != REDIS_REPLY_ARRAY) || (reply->elements != n)) { err = 500; }
+	if(err) {
+		if(reply) { freeReplyObject(reply); }
+		for(k=0; k<n; k++) { b->items[idx[k]].status = err; }
+		return 1;
+	}
+
+	b->replies[b->rcount++] = reply;
+	return 0;
+}
+
+static inline int is_noscript(redisReply *reply)
+{
+	return ((reply->type == REDIS_REPLY_ERROR) && (strncmp(reply->str, "NOSCRIPT", 8) == 0));
+}
+
+// Keep a string reply for the response, or drop it and set the status of a miss
+static void batch_keep(wsrt_t *rt, wsbatch_t *b, wsitem_t *it, redisReply *reply)
+{
+	if(!reply) { it->status = 503; return; }
+
+	if(reply->type == REDIS_REPLY_STRING) {
+		b->replies[b->rcount++] = reply;
+		it->status = MHD_HTTP_OK;
+		it->val = reply;
+		if(rt->bar && rt->icaching) { wsic_del(rt->ic, it->token); }
+		return;
+	}
+
+	it->status = (reply->type == REDIS_REPLY_NIL) ? MHD_HTTP_NOT_FOUND : 500;
+	freeReplyObject(reply);
+}
+
+// A cluster only takes multi-key commands within one slot, and random tokens almost never share one
+// So a master gets the GET (or GETBURN with BAR) of each of its tokens in one pipeline
+static void batch_fetch_pipeline(wsrt_t *rt, wsbatch_t *b, int n, int *idx)
+{
+	int k;
+	wscmd_t *cmds, *cmd;
+	wsitem_t *it;
+	redisReply *reply;
+
+	cmds = malloc(n * sizeof(wscmd_t));
+	if(!cmds) {
+		for(k=0; k<n; k++) { b->items[idx[k]].status = 500; }
+		return;
+	}
+
+	for(k=0; k<n; k++) {
+		it = &b->items[idx[k]];
+		cmd = &cmds[k];
+		cmd->key = it->token;
+		if(rt->bar) {
+			cmd->argc = 4;
+			cmd->argv[0] = "EVALSHA";						cmd->argvlen[0] = 7;
+			cmd->argv[1] = rt->scripts[WSSCRIPT_GETBURN].sha;	cmd->argvlen[1] = 40;
+			cmd->argv[2] = "1";								cmd->argvlen[2] = 1;
+			cmd->argv[3] = it->token;						cmd->argvlen[3] = strlen(it->token);
+		} else {
+			cmd->argc = 2;
+			cmd->argv[0] = "GET";							cmd->argvlen[0] = 3;
+			cmd->argv[1] = it->token;						cmd->argvlen[1] = strlen(it->token);
+		}
+	}
+
+	ws_redis_pipeline(rt, b->items[idx[0]].token, n, cmds);
+
+	for(k=0; k<n; k++) {
+		it = &b->items[idx[k]];
+		reply = cmds[k].reply;
+
+		// A node that lost our script gets it back through EVAL
+		if(reply && rt->bar && is_noscript(reply)) {
+			freeReplyObject(reply);
+			reply = ws_redis_script(rt, WSSCRIPT_GETBURN, it->token, 0, NULL);
+		}
+		batch_keep(rt, b, it, reply);
+	}
+
+	free(cmds);
+}
+
+// Without a cluster a backend gets one MGET, from a read replica when we have them
+// With BAR it gets one MGETBURN on the primary, so that every object is still only read once
+static void batch_fetch_mget(wsrt_t *rt, wsbatch_t *b, int n, int *idx, const char **keys, int primary)
+{
+	int k;
+	size_t keylens[WSBATCH_MAX+1];
+	redisReply *reply, *e;
+	wsitem_t *it;
+
+	if(rt->bar) { reply = ws_redis_script_keys(rt, WSSCRIPT_MGETBURN, n, &keys[1], 0, NULL); }
+	else {
+		keys[0] = "MGET";
+		for(k=0; k<=n; k++) { keylens[k] = strlen(keys[k]); }
+		if(primary) { reply = ws_redis_argv(rt, keys[1], n+1, keys, keylens); }
+		else { reply = ws_redis_read_argv(rt, keys[1], n+1, keys, keylens); }
+	}
+	if(batch_reply(b, reply, n, idx)) { return; }
+
+	for(k=0; k<n; k++) {
+		it = &b->items[idx[k]];
+		e = reply->element[k];
+		if(e->type == REDIS_REPLY_STRING) {
+			it->status = MHD_HTTP_OK;
+			it->val = e;
+			if(rt->bar && rt->icaching) { wsic_del(rt->ic, it->token); }
+		} else { it->status = MHD_HTTP_NOT_FOUND; }
+	}
+}
+
+// One round trip per backend for every unresolved token
+static void batch_fetch_pass(wsrt_t *rt, wsbatch_t *b, int primary)
+{
+	int i, n;
+	int idx[WSBATCH_MAX];
+	const char *keys[WSBATCH_MAX+1];
+
+	for(i=0; i<b->count; i++) {
+		if(b->items[i].status) { continue; }
+		n = batch_group(b, i, &keys[1], idx);
+		if(rt->clustered) { batch_fetch_pipeline(rt, b, n, idx); }
+		else { batch_fetch_mget(rt, b, n, idx, keys, primary); }
+	}
+}
+
+static void batch_fetch(wsrt_t *rt, wsbatch_t *b)
+{
+	int i;
+
+	batch_fetch_pass(rt, b, 0);
+
+	// With read-your-writes, replica misses are asked again on the primary (the SET may not have replicated yet)
+	if(!rt->replicas || !rt->ryw || rt->bar) { return; }
+	for(i=0; i<b->count; i++) {
+		if(b->items[i].status == MHD_HTTP_NOT_FOUND) { b->items[i].status = 0; }
+	}
+	batch_fetch_pass(rt, b, 1);
+}
+
+// Pipelined EXISTS per backend, objects are never read (or burnt)
+// return 0, or 503 if any backend did not answer
+static int batch_probe(wsrt_t *rt, wsbatch_t *b)
+{
+	int i, k, n, err = 0;
+	int idx[WSBATCH_MAX];
+	const char *keys[WSBATCH_MAX];
+	wscmd_t *cmds;
+	redisReply *reply;
+	wsitem_t *it;
+
+	// Tokens in the immutable cache are known to exist
+	if(rt->icaching) {
+		for(i=0; i<b->count; i++) {
+			it = &b->items[i];
+			if(!it->status && wsic_has(rt->ic, it->token)) { it->status = MHD_HTTP_OK; }
+		}
+	}
+
+	cmds = malloc(b->count * sizeof(wscmd_t));
+	if(!cmds) { return 500; }
+
+	for(i=0; i<b->count; i++) {
+		if(b->items[i].status) { continue; }
+		n = batch_group(b, i, keys, idx);
+		for(k=0; k<n; k++) {
+			cmds[k].key = keys[k];
+			cmds[k].argc = 2;
+			cmds[k].argv[0] = "EXISTS";		cmds[k].argvlen[0] = 6;
+			cmds[k].argv[1] = keys[k];		cmds[k].argvlen[1] = strlen(keys[k]);
+		}
+
+		ws_redis_pipeline(rt, keys[0], n, cmds);
+
+		for(k=0; k<n; k++) {
+			reply = cmds[k].reply;
+			if(!reply) { err = 503; }
+			if(reply && (reply->type == REDIS_REPLY_INTEGER) && (reply->integer > 0)) { b->items[idx[k]].status = MHD_HTTP_OK; }
+			else { b->items[idx[k]].status = MHD_HTTP_NOT_FOUND; }
+			if(reply) { freeReplyObject(reply); }
+		}
+	}
+
+	free(cmds);
+	return err;
+}
+
+// Translate the reply to a SET into an item status
+static inline int batch_set_status(redisReply *reply)
+{
+	int z;
+
+	if(!reply) { return 503; }
+	z = post_reply_status(reply);
+	return z ? z : MHD_HTTP_OK;
+}
+
+// Without EXPIRATION and IMMUTABLE a group is one MSET (never in a cluster, MSET can not span slots)
+static void batch_mset(wsrt_t *rt, wsbatch_t *b, int n, int *idx)
+{
+	int k, z;
+	const char **argv;
+	size_t *argvlen;
+	redisReply *reply;
+	wsitem_t *it;
+
+	argv = malloc((1+2*n) * sizeof(char *));
+	argvlen = malloc((1+2*n) * sizeof(size_t));
+	if(!argv || !argvlen) {
+		free(argv);
+		free(argvlen);
+		for(k=0; k<n; k++) { b->items[idx[k]].status = 500; }
+		return;
+	}
+
+	argv[0] = "MSET";	argvlen[0] = 4;
+	for(k=0; k<n; k++) {
+		it = &b->items[idx[k]];
+		argv[1+2*k] = it->token;					argvlen[1+2*k] = strlen(it->token);
+		argv[2+2*k] = (const char *)it->data;		argvlen[2+2*k] = it->len;
+	}
+
+	reply = ws_redis_argv(rt, argv[1], 1+2*n, argv, argvlen);
+	z = batch_set_status(reply);
+	if(reply) { freeReplyObject(reply); }
+	for(k=0; k<n; k++) { b->items[idx[k]].status = z; }
+
+	free(argv);
+	free(argvlen);
+}
+
+// Otherwise a group (a shard, or every key of one cluster master) is our SET template, pipelined
+static void batch_pipeline(wsrt_t *rt, wsbatch_t *b, int n, int *idx)
+{
+	int k;
+	wscmd_t *cmds;
+	wsitem_t *it;
+
+	cmds = malloc(n * sizeof(wscmd_t));
+	if(!cmds) {
+		for(k=0; k<n; k++) { b->items[idx[k]].status = 500; }
+		return;
+	}
+
+	for(k=0; k<n; k++) {
+		it = &b->items[idx[k]];
+		cmds[k].key = it->token;
+		cmds[k].argc = rt->set.argc;
+		set_template_fill(rt, cmds[k].argv, cmds[k].argvlen, it->token, it->data, it->len);
+	}
+
+	ws_redis_pipeline(rt, b->items[idx[0]].token, n, cmds);
+
+	for(k=0; k<n; k++) {
+		b->items[idx[k]].status = batch_set_status(cmds[k].reply);
+		if(cmds[k].reply) { freeReplyObject(cmds[k].reply); }
+	}
+
+	free(cmds);
+}
+
+// Write every valid item, one round trip per backend
+static void batch_store(wsrt_t *rt, wsbatch_t *b)
+{
+	int i, n;
+	int idx[WSBATCH_MAX];
+	const char *keys[WSBATCH_MAX];
+	wsitem_t *it;
+
+	// Immutable objects we know about are answered without a write
+	if(rt->immutable && rt->icaching) {
+		for(i=0; i<b->count; i++) {
+			it = &b->items[i];
+			if(!it->status && wsic_has(rt->ic, it->token)) { it->status = 304; }
+		}
+	}
+
+	for(i=0; i<b->count; i++) {
+		if(b->items[i].status) { continue; }
+		n = batch_group(b, i, keys, idx);
+		if(rt->expiration || rt->immutable || rt->clustered) { batch_pipeline(rt, b, n, idx); }
+		else { batch_mset(rt, b, n, idx); }
+	}
+
+	if(!rt->icaching) { return; }
+	for(i=0; i<b->count; i++) {
+		it = &b->items[i];
+		if(it->status == MHD_HTTP_OK) { wsic_add(rt->ic, it->token); }
+	}
+}
+
+// The head of the frame of item i
+static size_t batch_head(wsitem_t *it, char *buf, size_t size)
+{
+	return snprintf(buf, size, "%s %d %zu\n", it->token, it->status, it->val ? it->val->len : 0);
+}
+
+// return the size of the framed response
+static uint64_t batch_frame_size(wsbatch_t *b)
+{
+	int i;
+	uint64_t size = 0;
+	wsitem_t *it;
+
+	for(i=0; i<b->count; i++) {
+		it = &b->items[i];
+		size += batch_head(it, b->head, sizeof(b->head)) + 1;
+		if(it->val) { size += it->val->len; }
+	}
+
+	return size;
+}
+
+// Frame every item in request order, straight from the kept replies, as the client drains the socket
+static ssize_t batch_reader(void *cls, uint64_t pos, char *buf, size_t max)
+{
+	size_t n = 0, k, vlen;
+	const char *src;
+	wsbatch_t *b = cls;
+	wsitem_t *it;
+
+	if(pos != b->pos) { return MHD_CONTENT_READER_END_WITH_ERROR; }
+
+	while((n < max) && (b->cur < b->count)) {
+		it = &b->items[b->cur];
+		vlen = it->val ? it->val->len : 0;
+		if(b->off == 0) { b->headlen = batch_head(it, b->head, sizeof(b->head)); }
+
+		if(b->off < b->headlen) {
+			src = b->head + b->off;
+			k = b->headlen - b->off;
+		} else if(b->off < b->headlen + vlen) {
+			src = it->val->str + (b->off - b->headlen);
+			k = b->headlen + vlen - b->off;
+		} else {
+			src = "\n";
+			k = 1;
+		}
+		if(k > max-n) { k = max-n; }
+		memcpy(buf+n, src, k);
+		n += k;
+		b->off += k;
+
+		if(b->off == b->headlen + vlen + 1) {
+			b->cur++;
+			b->off = 0;
+		}
+	}
+
+	b->pos += n;
+	return n;
+}
+
+// One status line for every item in request order
+// return the response, it must be free()'d
+static char* batch_status(wsbatch_t *b)
+{
+	int i;
+	size_t n = 0, size = 1;
+	char *out;
+
+	size += b->count * (128 + 8);
+	out = malloc(size);
+	if(!out) { return NULL; }
+	out[0] = 0;
+
+	for(i=0; i<b->count; i++) {
+		n += snprintf(out+n, size-n, "%s %d\n", b->items[i].token, b->items[i].status);
+	}
+
+	return out;
+}
+
+// One bit per item in request order
+// return the response, it must be free()'d
+static unsigned char* batch_bitmap(wsbatch_t *b, size_t *len)
+{
+	int i;
+	unsigned char *out;
+
+	*len = ((unsigned int)b->count + 7) / 8;
+	out = calloc(1, *len);
+	if(!out) { return NULL; }
+
+	for(i=0; i<b->count; i++) {
+		if(b->items[i].status == MHD_HTTP_OK) { out[i/8] |= 0x80 >> (i%8); }
+	}
+
+	return out;
+}
+
+// return the number of items with status z
+static int batch_count(wsbatch_t *b, int z)
+{
+	int i, n = 0;
+
+	for(i=0; i<b->count; i++) {
+		if(b->items[i].status == z) { n++; }
+	}
+
+	return n;
+}
+
+// /batch runs blocking redis commands, which must never run on the async select thread
+static char* batch_async(srci_t *ri, const char *op)
+{
+	srci_set_return_code(ri, MHD_HTTP_NOT_IMPLEMENTED);
+	log_add(WSLOG_WARN, "%s %d BATCH %s ASYNC", srci_get_client_ip(ri), MHD_HTTP_NOT_IMPLEMENTED, op);
+	return strdup("not implemented: batch operations with async redis");
+}
+
+static char* batch_get(wsrt_t *rt, srci_t *ri)
+{
+	int found;
+	wsbatch_t *b;
+
+	if(rt->async) { return batch_async(ri, "GET"); }
+
+	b = batch_new(ri);
+	if(!b) { return strdup("malformed request - invalid token list"); }
+	if(batch_tokens(rt, b, ri)) {
+		batch_del(b);
+		return strdup("malformed request - invalid token list");
+	}
+
+	// A second (primary) pass for read your writes can keep as many replies again
+	b->replies = calloc(2 * b->count, sizeof(redisReply *));
+	if(!b->replies) {
+		batch_del(b);
+		srci_set_return_code(ri, MHD_HTTP_INTERNAL_SERVER_ERROR);
+		return strdup("internal server error");
+	}
+
+	batch_fetch(rt, b);
+	found = batch_count(b, MHD_HTTP_OK);
+
+	// The batch owns the replies until the response has been sent, batch_del() is called then
+	srci_set_return_code(ri, MHD_HTTP_OK);
+	srci_set_response_content_type(ri, WSBATCH_CT);
+	srci_set_return_reader(ri, batch_frame_size(b), WSBATCH_BLOCK, &batch_reader, &batch_del, b);
+	log_add(WSLOG_INFO, "%s %d BATCH GET %d/%d%s", srci_get_client_ip(ri), MHD_HTTP_OK, found, b->count, rt->bar ? " BURNT" : "");
+	return NULL;
+}
+
+static char* batch_post(wsrt_t *rt, srci_t *ri)
+{
+	int stored, notmod;
+	char *out;
+	wsbatch_t *b;
+
+	if(rt->async) { return batch_async(ri, "POST"); }
+
+	b = batch_new(ri);
+	if(!b) { return strdup("malformed request - invalid frames"); }
+	if(batch_frames(rt, b, ri)) {
+		batch_del(b);
+		return strdup("malformed request - invalid frames");
+	}
+
+	batch_store(rt, b);
+	stored = batch_count(b, MHD_HTTP_OK);
+	notmod = batch_count(b, 304);
+
+	out = batch_status(b);
+	if(!out) {
+		batch_del(b);
+		srci_set_return_code(ri, MHD_HTTP_INTERNAL_SERVER_ERROR);
+		return strdup("internal server error");
+	}
+
+	srci_set_return_code(ri, MHD_HTTP_OK);
+	srci_set_response_content_type(ri, WSBATCH_CT);
+	log_add(WSLOG_INFO, "%s %d BATCH POST %d/%d NOTMOD %d", srci_get_client_ip(ri), MHD_HTTP_OK, stored, b->count, notmod);
+	batch_del(b);
+	return out;
+}
+
+static char* batch_exists(wsrt_t *rt, srci_t *ri)
+{
+	int z, found, count;
+	size_t len = 0;
+	unsigned char *out;
+	wsbatch_t *b;
+
+	if(rt->async) { return batch_async(ri, "EXISTS"); }
+
+	b = batch_new(ri);
+	if(!b) { return strdup("malformed request - invalid token list"); }
+	if(batch_tokens(rt, b, ri)) {
+		batch_del(b);
+		return strdup("malformed request - invalid token list");
+	}
+
+	// A bitmap can not tell missing from unknown, so any failure fails the batch
+	z = batch_probe(rt, b);
+	if(z) {
+		batch_del(b);
+		srci_set_return_code(ri, z);
+		return strdup((z == 503) ? "service unavailable" : "internal server error");
+	}
+
+	found = batch_count(b, MHD_HTTP_OK);
+	count = b->count;
+	out = batch_bitmap(b, &len);
+	batch_del(b);
+	if(!out) {
+		srci_set_return_code(ri, MHD_HTTP_INTERNAL_SERVER_ERROR);
+		return strdup("internal server error");
+	}
+
+	srci_set_return_code(ri, MHD_HTTP_OK);
+	srci_set_response_content_type(ri, MIMETYPEAPPBINSTR);
+	srci_set_return_data(ri, out, len, &free, out);
+	log_add(WSLOG_INFO, "%s %d BATCH EXISTS %d/%d", srci_get_client_ip(ri), MHD_HTTP_OK, found, count);
+	return NULL;
+}
+
+char* nodebatch(char *url, int urllen, srci_t *ri, void *sri_user_data, void *node_user_data)
+{
+	wsrt_t *rt = (wsrt_t *)sri_user_data;
+
+	if(shutting_down()) {
+		srci_set_return_code(ri, MHD_HTTP_SERVICE_UNAVAILABLE);
+		return strdup("service unavailable: shutting down");
+	}
+
+	if(METHOD(ri) != METHOD_POST) {
+		srci_set_return_code(ri, MHD_HTTP_METHOD_NOT_ALLOWED);
+		log_add(WSLOG_WARN, "%s %d METHOD_NOT_ALLOWED", srci_get_client_ip(ri), ri->return_code);
+		return strdup("method not allowed");
+	}
+
+	if(strcmp(url, "get") == 0) { return batch_get(rt, ri); }
+	if(strcmp(url, "post") == 0) { return batch_post(rt, ri); }
+	if(strcmp(url, "exists") == 0) { return batch_exists(rt, ri); }
+
+	srci_set_return_code(ri, MHD_HTTP_NOT_FOUND);
+	return strdup("unknown batch operation");
+}
@@ -0,0 +1,103 @@
+/*
+	webstore is a web-based arbitrary data storage service that accepts z85 encoded data 
+	Copyright (C) 2021 Brett Kuskie <fullaxx@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; version 2 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "webstore_ops.h"
+
+// Tokens are already uniformly distributed hex, FNV-1a spreads them over the slots
+static unsigned int wsic_slot(const char *token)
+{
+	unsigned int h = 2166136261U;
+
+	while(*token) {
+		h ^= (unsigned char)*token++;
+		h *= 16777619U;
+	}
+
+	return (h % WSIC_SLOTS);
+}
+
+// Keep each token known to exist for ttl seconds
+// return 0 on success
+int wsic_init(wsic_t *ic, long ttl)
+{
+	memset(ic, 0, sizeof(wsic_t));
+	ic->slots = calloc(WSIC_SLOTS, sizeof(wsic_entry_t));
+	if(!ic->slots) { return 1; }
+	ic->ttl = ttl * 1000;
+	pthread_mutex_init(&ic->lock, NULL);
+
+	return 0;
+}
+
+// return 1 if token was seen in redis less than ttl seconds ago
+int wsic_has(wsic_t *ic, const char *token)
+{
+	int found;
+	wsic_entry_t *e = &ic->slots[wsic_slot(token)];
+
+	pthread_mutex_lock(&ic->lock);
+	found = ((e->until > rai_now_ms()) && (strcmp(e->token, token) == 0));
+	pthread_mutex_unlock(&ic->lock);
+
+	return found;
+}
+
+// left is how long (ms) the object has to live in redis, -1 if it never expires
+// A token is never remembered past its object, so a 304 never answers for an expired object
+// A collision simply replaces the older token
+void wsic_add_pttl(wsic_t *ic, const char *token, long long left)
+{
+	long long ttl = ic->ttl;
+	wsic_entry_t *e = &ic->slots[wsic_slot(token)];
+
+	if(strlen(token) >= sizeof(e->token)) { return; }
+	if((left >= 0) && (left < ttl)) { ttl = left; }
+	if(ttl <= 0) { return; }
+
+	pthread_mutex_lock(&ic->lock);
+	strcpy(e->token, token);
+	e->until = rai_now_ms() + ttl;
+	pthread_mutex_unlock(&ic->lock);
+}
+
+// The object was just stored, ttl is already capped at EXPIRATION
+void wsic_add(wsic_t *ic, const char *token)
+{
+	wsic_add_pttl(ic, token, -1);
+}
+
+// The object is gone (burnt after reading)
+void wsic_del(wsic_t *ic, const char *token)
+{
+	wsic_entry_t *e = &ic->slots[wsic_slot(token)];
+
+	pthread_mutex_lock(&ic->lock);
+	if(strcmp(e->token, token) == 0) { e->until = 0; }
+	pthread_mutex_unlock(&ic->lock);
+}
+
+void wsic_free(wsic_t *ic)
+{
+	pthread_mutex_destroy(&ic->lock);
+	free(ic->slots);
+	ic->slots = NULL;
+}
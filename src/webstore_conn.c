@@ -16,47 +16,40 @@
 	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
 
-//#include <stdio.h>
+#include <stdio.h>
 #include <stdlib.h>
-//#include <string.h>
+#include <string.h>
 //#include <unistd.h>
 //#include <ctype.h>
 
 #include "webstore_ops.h"
 #include "webstore_log.h"
 
-static inline void save_ip(rai_t *rc, char *ip, int found, int reqperiod)
-{
-	redisReply *reply;
-
-	if(found == 0) {
-		reply = redisCommand(rc->c, "SET IPS:%s 1 EX %d", ip, reqperiod);
-	} else {
-		reply = redisCommand(rc->c, "INCR IPS:%s", ip);
-	}
-	if(!reply) { handle_redis_error(rc); return; }
-	freeReplyObject(reply);
-}
-
 static int check_ip(wsrt_t *lrt, char *ip)
 {
-	int count, retval = 1;
+	long long count;
+	int retval = 1;
+	char key[128];
+	char period[16];
+	char maxcount[24];
+	const char *args[2];
 	redisReply *reply;
-	rai_t *rc = &lrt->rc;
 
-	reply = redisCommand(rc->c, "GET IPS:%s", ip);
-	if(!reply) { handle_redis_error(rc); return 0; }
-	if(reply->type == REDIS_REPLY_NIL) {
-		// KEY DOES NOT EXIST
-		log_add(WSLOG_INFO, "%s new connection allowed (count: 1)", ip);
-		save_ip(rc, ip, 0, lrt->reqperiod);
-	} else if(reply->type == REDIS_REPLY_STRING) {
-		count = atoi(reply->str);
-		if(count < lrt->reqcount) {
-			log_add(WSLOG_INFO, "%s new connection allowed (count: %d)", ip, count+1);
-			save_ip(rc, ip, 1, lrt->reqperiod);
+	snprintf(key, sizeof(key), "IPS:%s", ip);
+	snprintf(period, sizeof(period), "%d", lrt->reqperiod);
+	snprintf(maxcount, sizeof(maxcount), "%ld", lrt->reqcount);
+	args[0] = period;
+	args[1] = maxcount;
+
+	// Check and count this connection in one round trip
+	reply = ws_redis_script(lrt, WSSCRIPT_RATELIMIT, key, 2, args);
+	if(!reply) { return 0; }
+	if(reply->type == REDIS_REPLY_INTEGER) {
+		count = reply->integer;
+		if(count > 0) {
+			log_add(WSLOG_INFO, "%s new connection allowed (count: %lld)", ip, count);
 		} else {
-			log_add(WSLOG_INFO, "%s new connection denied (count: %d)", ip, count+1);
+			log_add(WSLOG_INFO, "%s new connection denied (count: %lld)", ip, -count);
 			retval = 0;
 		}
 	} else { retval = 0; }	// THIS SHOULD NEVER HAPPEN
@@ -70,12 +63,5 @@ static int check_ip(wsrt_t *lrt, char *ip)
 // Return 0 if connection is denied
 int allow_ip(wsrt_t *lrt, char *ip)
 {
-	int retval;
-
-	//LOCK RAI if redis calls are in their own thread, using a shared context
-	if(lrt->multithreaded) { rai_lock(&lrt->rc); }
-	retval = check_ip(lrt, ip);
-	if(lrt->multithreaded) { rai_unlock(&lrt->rc); }
-
-	return retval;
+	return check_ip(lrt, ip);
 }
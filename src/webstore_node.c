@@ -19,7 +19,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-//#include <unistd.h>
+#include <unistd.h>
 #include <ctype.h>
 
 #include "webstore.h"
@@ -51,7 +51,7 @@ static int is_Z85_digit(char digit)
 }
 
 // return FALSE if any character in ptr is not a valid z85 digit
-static int Z85_validate(const unsigned char *ptr, size_t len)
+int Z85_validate(const unsigned char *ptr, size_t len)
 {
 	size_t i;
 	for(i=0; i<len; i++) {
@@ -84,22 +84,374 @@ static char* convert_hash(char *input, int len)
 	return strdup(newhash);
 }
 
-static inline void do_redis_del(rai_t *rc, char *hash)
+// Everything an async reply callback needs to finish the request
+typedef struct {
+	wsrt_t *rt;
+	srci_t *ri;
+	char *url;
+	char *hash;
+	long long size;		// HEAD keeps the replies to STRLEN and TTL until both are in
+	long long ttl;
+	int err;
+	int refs;
+} wsasync_t;
+
+static wsasync_t* wsasync_new(wsrt_t *rt, srci_t *ri, char *url, char *hash)
+{
+	wsasync_t *wa = calloc(1, sizeof(wsasync_t));
+	if(!wa) { return NULL; }
+	wa->rt = rt;
+	wa->ri = ri;
+	wa->url = url;
+	wa->hash = hash;
+	return wa;
+}
+
+static void wsasync_del(wsasync_t *wa)
+{
+	if(wa->hash) { free(wa->hash); }
+	free(wa);
+}
+
+// Set the return code, log the result and create the page for a GET
+// A found object has already been handed to srci_set_return_data(), return NULL
+static char* get_respond(char *url, wsrt_t *rt, srci_t *ri, int found, int err)
+{
+	char *log_fmt;
+	char log_entry[512];
+
+	if(err == 503) {
+		srci_set_return_code(ri, MHD_HTTP_SERVICE_UNAVAILABLE);
+		return strdup("service unavailable");
+	}
+
+	if(!found) {
+		srci_set_return_code(ri, MHD_HTTP_NOT_FOUND);
+		log_add(WSLOG_INFO, "%s %d GET %s", srci_get_client_ip(ri), MHD_HTTP_NOT_FOUND, url);
+		return strdup("not found");
+	}
+
+	srci_set_return_code(ri, MHD_HTTP_OK);
+	if(!rt->async && !rt->bar) { srci_add_response_header(ri, "Accept-Ranges", "bytes"); }
+	if(rt->bar) { log_fmt = "%s %d GET %s BURNT"; }
+	else { log_fmt = "%s %d GET %s"; }
+	snprintf(log_entry, sizeof(log_entry), log_fmt, srci_get_client_ip(ri), MHD_HTTP_OK, url);
+	log_add(WSLOG_INFO, "%s", log_entry);
+	return NULL;
+}
+
+// Called from the async event loop thread
+static void get_async_cb(redisAsyncContext *ac, void *r, void *privdata)
+{
+	int z;
+	int err = 0;
+	int found = 0;
+	char *page;
+	void *data;
+	redisReply *reply = r;
+	wsasync_t *wa = privdata;
+
+	if(reply && wa->rt->bar && (reply->type == REDIS_REPLY_ERROR) && (strncmp(reply->str, "NOSCRIPT", 8) == 0)) {
+		// redis lost our script, EVAL reloads it
+		z = redisAsyncCommand(ac, &get_async_cb, wa, "EVAL %s 1 %s", wa->rt->scripts[WSSCRIPT_GETBURN].src, wa->hash);
+		if(z == REDIS_OK) { return; }
+		reply = NULL;
+	}
+
+	if(!reply) {
+		err = 503;
+	} else if(reply->type == REDIS_REPLY_STRING) {
+		// hiredis frees async replies when we return, so we need our own copy
+		data = malloc(reply->len);
+		if(data) {
+			memcpy(data, reply->str, reply->len);
+			srci_set_return_data(wa->ri, data, reply->len, &free, data);
+			found = 1;
+		} else { err = 503; }
+	}
+	if(found && wa->rt->bar && wa->rt->icaching) { wsic_del(wa->rt->ic, wa->hash); }
+
+	page = get_respond(wa->url, wa->rt, wa->ri, found, err);
+	srci_resume(wa->ri, page);
+	wsasync_del(wa);
+}
+
+// Issue the GET without blocking, the connection is suspended until get_async_cb()
+static char* get_async(wsreq_t *req, wsrt_t *rt, srci_t *ri, char *hash)
+{
+	int z;
+	wsasync_t *wa;
+
+	wa = wsasync_new(rt, ri, req->url, hash);
+	if(!wa) {
+		free(hash);
+		srci_set_return_code(ri, MHD_HTTP_INTERNAL_SERVER_ERROR);
+		return strdup("internal server error");
+	}
+
+	srci_suspend(ri);
+	if(rt->bar) { z = raia_command(&rt->ra, &get_async_cb, wa, "EVALSHA %s 1 %s", rt->scripts[WSSCRIPT_GETBURN].sha, hash); }
+	else { z = raia_command(&rt->ra, &get_async_cb, wa, "GET %s", hash); }
+	if(z != REDIS_OK) {
+		wsasync_del(wa);
+		srci_resume(ri, get_respond(req->url, rt, ri, 0, 503));
+	}
+
+	return NULL;
+}
+
+// Fill in a command of the form: CMD <key>
+static inline void key_command(wscmd_t *cmd, const char *name, const char *key)
+{
+	cmd->key = key;
+	cmd->argc = 2;
+	cmd->argv[0] = name;	cmd->argvlen[0] = strlen(name);
+	cmd->argv[1] = key;		cmd->argvlen[1] = strlen(key);
+}
+
+// Parse a single byte range: bytes=a-b, bytes=a- or bytes=-n
+// first and last are GETRANGE offsets, negative offsets count from the end
+// return 0 if the range is usable, anything else is answered with the whole object
+static int parse_range(const char *h, long long *first, long long *last)
+{
+	char *e;
+	long long a, b;
+
+	if(strncmp(h, "bytes=", 6) != 0) { return 1; }
+	h += 6;
+	if(strchr(h, ',')) { return 1; }
+
+	if(*h == '-') {
+		b = strtoll(h+1, &e, 10);
+		if((e == h+1) || *e || (b <= 0)) { return 1; }
+		*first = -b;
+		*last = -1;
+		return 0;
+	}
+
+	if(!isdigit(*h)) { return 1; }
+	a = strtoll(h, &e, 10);
+	if(*e != '-') { return 1; }
+	h = e+1;
+	if(*h == 0) {
+		*first = a;
+		*last = -1;
+		return 0;
+	}
+
+	if(!isdigit(*h)) { return 1; }
+	b = strtoll(h, &e, 10);
+	if(*e || (b < a)) { return 1; }
+	*first = a;
+	*last = b;
+	return 0;
+}
+
+// Pipeline read only commands to a read replica when we have them
+// cmds[0] must be a STRLEN, with read-your-writes a replica miss is asked again on the primary
+// return 1 if the replies came from the primary
+static int read_pipeline(wsrt_t *rt, const char *hash, int n, wscmd_t *cmds)
 {
+	int i;
+	redisReply *r = NULL;
+
+	ws_redis_read_pipeline(rt, hash, n, cmds);
+	if(!rt->replicas) { return 1; }
+	if(!rt->ryw) { return 0; }
+
+	r = cmds[0].reply;
+	if(!r || (r->type != REDIS_REPLY_INTEGER) || (r->integer != 0)) { return 0; }
+	for(i=0; i<n; i++) {
+		if(cmds[i].reply) { freeReplyObject(cmds[i].reply); }
+	}
+	ws_redis_pipeline(rt, hash, n, cmds);
+	return 1;
+}
+
+// Answer a Range request with 206 and only the bytes asked for
+// STRLEN and GETRANGE are pipelined (to a read replica when we have them), STRLEN gives us the size for Content-Range
+static char* get_range(wsreq_t *req, wsrt_t *rt, srci_t *ri, char *hash, long long first, long long last)
+{
+	long long size, from, to;
+	char a[32], b[32];
+	char cr[96];
+	wscmd_t cmds[2];
 	redisReply *reply;
-	reply = redisCommand(rc->c, "DEL %s", hash);
-	freeReplyObject(reply);
+
+	snprintf(a, sizeof(a), "%lld", first);
+	snprintf(b, sizeof(b), "%lld", last);
+	key_command(&cmds[0], "STRLEN", hash);
+	key_command(&cmds[1], "GETRANGE", hash);
+	cmds[1].argc = 4;
+	cmds[1].argv[2] = a;	cmds[1].argvlen[2] = strlen(a);
+	cmds[1].argv[3] = b;	cmds[1].argvlen[3] = strlen(b);
+	read_pipeline(rt, hash, 2, cmds);
+	free(hash);
+
+	reply = cmds[1].reply;
+	if(!cmds[0].reply || !reply) {
+		if(cmds[0].reply) { freeReplyObject(cmds[0].reply); }
+		if(reply) { freeReplyObject(reply); }
+		return get_respond(req->url, rt, ri, 0, 503);
+	}
+
+	size = (cmds[0].reply->type == REDIS_REPLY_INTEGER) ? cmds[0].reply->integer : 0;
+	freeReplyObject(cmds[0].reply);
+
+	// Every object is at least 5 bytes, so a size of 0 is a missing object
+	if((size == 0) || (reply->type != REDIS_REPLY_STRING)) {
+		freeReplyObject(reply);
+		return get_respond(req->url, rt, ri, 0, 0);
+	}
+
+	if(first >= size) {
+		freeReplyObject(reply);
+		snprintf(cr, sizeof(cr), "bytes */%lld", size);
+		srci_add_response_header(ri, "Content-Range", cr);
+		srci_set_return_code(ri, MHD_HTTP_RANGE_NOT_SATISFIABLE);
+		log_add(WSLOG_INFO, "%s %d GET %s RANGE", srci_get_client_ip(ri), MHD_HTTP_RANGE_NOT_SATISFIABLE, req->url);
+		return strdup("range not satisfiable");
+	}
+
+	from = (first < 0) ? ((size+first > 0) ? size+first : 0) : first;
+	to = from + reply->len - 1;
+	snprintf(cr, sizeof(cr), "bytes %lld-%lld/%lld", from, to, size);
+	srci_add_response_header(ri, "Content-Range", cr);
+
+	// The reply owns the slice until MHD has sent it
+	srci_set_return_data(ri, reply->str, reply->len, &freeReplyObject, reply);
+	srci_set_return_code(ri, MHD_HTTP_PARTIAL_CONTENT);
+	log_add(WSLOG_INFO, "%s %d GET %s RANGE %lld-%lld", srci_get_client_ip(ri), MHD_HTTP_PARTIAL_CONTENT, req->url, from, to);
+	return NULL;
+}
+
+// A streamed GET holds one window of the object at a time
+#define WSGET_BLOCK (32*1024)
+typedef struct {
+	wsrt_t *rt;
+	char hash[128+1];
+	redisReply *win;	// the window we are sending from
+	uint64_t winpos;	// offset of win in the object
+	int primary;		// the object was only found on the primary (read-your-writes)
+} wsget_t;
+
+static void wsget_del(void *cls)
+{
+	wsget_t *g = cls;
+
+	if(g->win) { freeReplyObject(g->win); }
+	free(g);
+}
+
+// Called by MHD as the socket drains, fetches the next window with GETRANGE when needed
+// Windows are read from where the first one came from (a read replica when we have them)
+// This blocks the MHD thread, which is why --sget requires -t or --tpool
+// An object that shrinks or expires mid-transfer drops the connection
+static ssize_t get_stream_reader(void *cls, uint64_t pos, char *buf, size_t max)
+{
+	wsget_t *g = cls;
+	size_t off, n;
+	char a[32], b[32];
+	const char *argv[4];
+	size_t argvlen[4];
+	redisReply *reply;
+
+	if(!g->win || (pos < g->winpos) || (pos >= g->winpos + g->win->len)) {
+		if(g->win) { freeReplyObject(g->win); }
+		g->win = NULL;
+
+		snprintf(a, sizeof(a), "%llu", (unsigned long long)pos);
+		snprintf(b, sizeof(b), "%llu", (unsigned long long)(pos + g->rt->sget - 1));
+		argv[0] = "GETRANGE";	argvlen[0] = 8;
+		argv[1] = g->hash;		argvlen[1] = strlen(g->hash);
+		argv[2] = a;			argvlen[2] = strlen(a);
+		argv[3] = b;			argvlen[3] = strlen(b);
+
+		if(g->primary) { reply = ws_redis_argv(g->rt, g->hash, 4, argv, argvlen); }
+		else { reply = ws_redis_read_argv(g->rt, g->hash, 4, argv, argvlen); }
+		if(!reply) { return MHD_CONTENT_READER_END_WITH_ERROR; }
+		if((reply->type != REDIS_REPLY_STRING) || (reply->len == 0)) {
+			freeReplyObject(reply);
+			return MHD_CONTENT_READER_END_WITH_ERROR;
+		}
+		g->win = reply;
+		g->winpos = pos;
+	}
+
+	off = pos - g->winpos;
+	n = g->win->len - off;
+	if(n > max) { n = max; }
+	memcpy(buf, g->win->str + off, n);
+	return n;
+}
+
+// Pipeline STRLEN with the first window, an object that fits in it is sent as usual
+// A larger object is handed to MHD with get_stream_reader(), only one window is held at a time
+static char* get_stream(wsreq_t *req, wsrt_t *rt, srci_t *ri, char *hash)
+{
+	int primary;
+	long long size;
+	char b[32];
+	wscmd_t cmds[2];
+	redisReply *reply;
+	wsget_t *g;
+
+	snprintf(b, sizeof(b), "%ld", rt->sget - 1);
+	key_command(&cmds[0], "STRLEN", hash);
+	key_command(&cmds[1], "GETRANGE", hash);
+	cmds[1].argc = 4;
+	cmds[1].argv[2] = "0";	cmds[1].argvlen[2] = 1;
+	cmds[1].argv[3] = b;	cmds[1].argvlen[3] = strlen(b);
+	primary = read_pipeline(rt, hash, 2, cmds);
+
+	reply = cmds[1].reply;
+	if(!cmds[0].reply || !reply) {
+		if(cmds[0].reply) { freeReplyObject(cmds[0].reply); }
+		if(reply) { freeReplyObject(reply); }
+		free(hash);
+		return get_respond(req->url, rt, ri, 0, 503);
+	}
+
+	size = (cmds[0].reply->type == REDIS_REPLY_INTEGER) ? cmds[0].reply->integer : 0;
+	freeReplyObject(cmds[0].reply);
+
+	// Every object is at least 5 bytes, so a size of 0 is a missing object
+	if((size == 0) || (reply->type != REDIS_REPLY_STRING) || (reply->len == 0)) {
+		freeReplyObject(reply);
+		free(hash);
+		return get_respond(req->url, rt, ri, 0, 0);
+	}
+
+	if(reply->len >= size) {
+		free(hash);
+		srci_set_return_data(ri, reply->str, reply->len, &freeReplyObject, reply);
+		return get_respond(req->url, rt, ri, 1, 0);
+	}
+
+	g = calloc(1, sizeof(wsget_t));
+	if(!g) {
+		freeReplyObject(reply);
+		free(hash);
+		srci_set_return_code(ri, MHD_HTTP_INTERNAL_SERVER_ERROR);
+		return strdup("internal server error");
+	}
+	g->rt = rt;
+	snprintf(g->hash, sizeof(g->hash), "%s", hash);
+	g->win = reply;
+	g->primary = primary;
+	free(hash);
+
+	srci_set_return_reader(ri, size, WSGET_BLOCK, &get_stream_reader, &wsget_del, g);
+	return get_respond(req->url, rt, ri, 1, 0);
 }
 
 static char* get(wsreq_t *req, wsrt_t *rt, srci_t *ri)
 {
 	int err = 0;
-	char *hash;
-	char *page = NULL;
-	char *log_fmt;
-	char log_entry[512];
+	int found = 0;
+	long long first, last;
+	char *hash, *range;
 	redisReply *reply;
-	rai_t *rc = &rt->rc;
 
 	// Check the URL length
 	if(req->urllen != req->hashlen) {
@@ -113,88 +465,431 @@ static char* get(wsreq_t *req, wsrt_t *rt, srci_t *ri)
 		return strdup("malformed request");
 	}
 
-	//LOCK RAI if redis calls are in their own thread, using a shared context
-	if(rt->multithreaded) { rai_lock(rc); }
-	reply = redisCommand(rc->c, "GET %s", hash);
+	if(rt->async) { return get_async(req, rt, ri, hash); }
+
+	// A BAR object is burnt by its first read, so it is always sent whole
+	range = srci_get_range(ri);
+	if(range && !rt->bar && !parse_range(range, &first, &last)) {
+		return get_range(req, rt, ri, hash, first, last);
+	}
+	if(rt->sget && !rt->bar) { return get_stream(req, rt, ri, hash); }
+
+	// BAR must GET and DELETE atomically, so that only one reader ever gets the object
+	if(rt->bar) { reply = ws_redis_script(rt, WSSCRIPT_GETBURN, hash, 0, NULL); }
+	else { reply = ws_redis_read(rt, hash); }
 	if(!reply) {
 		err = 503;
-		handle_redis_error(rc);
 	} else {
-		if(reply->type == REDIS_REPLY_STRING) { page = strdup(reply->str); }
-		if(page && rt->bar) { do_redis_del(rc, hash); }
-		freeReplyObject(reply);
+		if(reply->type == REDIS_REPLY_STRING) { found = 1; }
+
+		// The reply owns the object until MHD has sent it
+		if(found) { srci_set_return_data(ri, reply->str, reply->len, &freeReplyObject, reply); }
+		else { freeReplyObject(reply); }
+		if(found && rt->bar && rt->icaching) { wsic_del(rt->ic, hash); }
 	}
-	if(rt->multithreaded) { rai_unlock(rc); }
 	free(hash);
 
-	if(err == 503) {
-		srci_set_return_code(ri, MHD_HTTP_SERVICE_UNAVAILABLE);
-		return strdup("service unavailable");
+	return get_respond(req->url, rt, ri, found, err);
+}
+
+// Set the return code, log the result and create the (never sent) page for a HEAD
+// size and ttl are the replies to STRLEN and TTL
+static char* head_respond(char *url, srci_t *ri, int err, redisReply *size, redisReply *ttl)
+{
+	char str[32];
+
+	if(!err) {
+		if(!size || !ttl) { err = 503; }
+		else if((size->type != REDIS_REPLY_INTEGER) || (ttl->type != REDIS_REPLY_INTEGER)) { err = 500; }
+		else if(ttl->integer == -2) { err = 404; }	// TTL of a missing key
 	}
 
-	if(!page) {
-		srci_set_return_code(ri, MHD_HTTP_NOT_FOUND);
-		log_add(WSLOG_INFO, "%s %d GET %s", srci_get_client_ip(ri), MHD_HTTP_NOT_FOUND, req->url);
-		return strdup("not found");
+	if(!err) {
+		srci_set_head_length(ri, size->integer);
+		if(ttl->integer >= 0) {
+			snprintf(str, sizeof(str), "%lld", ttl->integer);
+			srci_add_response_header(ri, WSHDRTTL, str);
+		}
 	}
 
-	srci_set_return_code(ri, MHD_HTTP_OK);
-	if(rt->bar) { log_fmt = "%s %d GET %s BURNT"; }
-	else { log_fmt = "%s %d GET %s"; }
-	snprintf(log_entry, sizeof(log_entry), log_fmt, srci_get_client_ip(ri), MHD_HTTP_OK, req->url);
-	log_add(WSLOG_INFO, "%s", log_entry);
+	srci_set_return_code(ri, err ? err : MHD_HTTP_OK);
+	log_add(WSLOG_INFO, "%s %d HEAD %s", srci_get_client_ip(ri), err ? err : MHD_HTTP_OK, url);
+	return strdup("");
+}
+
+// STRLEN and TTL both hold a reference, whoever drops the last one answers the HEAD
+// Callbacks run on the async event loop thread, a command that could not be sent is dropped by head_async()
+static void head_async_put(wsasync_t *wa)
+{
+	redisReply size, ttl;
+
+	if(__atomic_sub_fetch(&wa->refs, 1, __ATOMIC_ACQ_REL) > 0) { return; }
+
+	memset(&size, 0, sizeof(size));
+	size.type = REDIS_REPLY_INTEGER;
+	size.integer = wa->size;
+	ttl = size;
+	ttl.integer = wa->ttl;
+
+	srci_resume(wa->ri, head_respond(wa->url, wa->ri, wa->err, &size, &ttl));
+	wsasync_del(wa);
+}
+
+// return the status of an integer reply, 0 if it is usable
+static inline int head_async_err(redisReply *reply)
+{
+	if(!reply) { return 503; }
+	return (reply->type == REDIS_REPLY_INTEGER) ? 0 : 500;
+}
+
+// Called from the async event loop thread with the reply to STRLEN
+static void head_async_size_cb(redisAsyncContext *ac, void *r, void *privdata)
+{
+	wsasync_t *wa = privdata;
+	int err = head_async_err(r);
+
+	if(err) { __atomic_store_n(&wa->err, err, __ATOMIC_RELAXED); }
+	else { wa->size = ((redisReply *)r)->integer; }
+	head_async_put(wa);
+}
+
+// Called from the async event loop thread with the reply to TTL
+static void head_async_ttl_cb(redisAsyncContext *ac, void *r, void *privdata)
+{
+	wsasync_t *wa = privdata;
+	int err = head_async_err(r);
+
+	if(err) { __atomic_store_n(&wa->err, err, __ATOMIC_RELAXED); }
+	else { wa->ttl = ((redisReply *)r)->integer; }
+	head_async_put(wa);
+}
+
+// Send STRLEN and TTL back to back without blocking, hiredis pipelines them in one round trip
+// The connection is suspended until both replies are in
+static char* head_async(wsreq_t *req, wsrt_t *rt, srci_t *ri, char *hash)
+{
+	int z;
+	wsasync_t *wa;
+
+	wa = wsasync_new(rt, ri, req->url, hash);
+	if(!wa) {
+		free(hash);
+		srci_set_return_code(ri, MHD_HTTP_INTERNAL_SERVER_ERROR);
+		return strdup("internal server error");
+	}
+
+	srci_suspend(ri);
+	wa->refs = 2;
+	z = raia_command(&rt->ra, &head_async_size_cb, wa, "STRLEN %s", hash);
+	if(z != REDIS_OK) {
+		wsasync_del(wa);
+		srci_resume(ri, head_respond(req->url, ri, 503, NULL, NULL));
+		return NULL;
+	}
+
+	// STRLEN is already on its way, its callback answers once we drop the reference of TTL
+	z = raia_command(&rt->ra, &head_async_ttl_cb, wa, "TTL %s", hash);
+	if(z != REDIS_OK) {
+		__atomic_store_n(&wa->err, 503, __ATOMIC_RELAXED);
+		head_async_put(wa);
+	}
+
+	return NULL;
+}
+
+// Report the size and remaining lifetime of an object, without moving it
+// STRLEN and TTL are pipelined (to a read replica when we have them), neither one burns a BAR object
+static char* head(wsreq_t *req, wsrt_t *rt, srci_t *ri)
+{
+	char *page;
+	char *hash;
+	wscmd_t cmds[2];
+
+	// Check the URL length
+	if(req->urllen != req->hashlen) {
+		srci_set_return_code(ri, MHD_HTTP_BAD_REQUEST);
+		return strdup("malformed request");
+	}
+
+	hash = convert_hash(req->url, req->urllen);
+	if(!hash) {
+		srci_set_return_code(ri, MHD_HTTP_BAD_REQUEST);
+		return strdup("malformed request");
+	}
+
+	if(rt->async) { return head_async(req, rt, ri, hash); }
+
+	key_command(&cmds[0], "STRLEN", hash);
+	key_command(&cmds[1], "TTL", hash);
+	read_pipeline(rt, hash, 2, cmds);
+	free(hash);
+
+	page = head_respond(req->url, ri, 0, cmds[0].reply, cmds[1].reply);
+	if(cmds[0].reply) { freeReplyObject(cmds[0].reply); }
+	if(cmds[1].reply) { freeReplyObject(cmds[1].reply); }
 	return page;
 }
 
-static int do_redis_post(wsrt_t *rt, const char *hash, const unsigned char *dataptr, size_t datalen)
+// Translate the reply to a SET into our return code
+int post_reply_status(redisReply *reply)
 {
 	int err = 500;
-	char *datastr;
+
+	if(reply->type == REDIS_REPLY_ERROR) { err = 417; }
+	if(reply->type == REDIS_REPLY_NIL) { err = 304; }
+	if(reply->type == REDIS_REPLY_STATUS) {
+		if(strncmp("OK", reply->str, 2) == 0) { err = 0; }
+	}
+
+	return err;
+}
+
+// Set the return code, log the result and create the page for a POST
+static char* post_respond(char *url, srci_t *ri, int z)
+{
+	if(z) {
+		srci_set_return_code(ri, z);
+		switch(z) {
+			case 304:
+				log_add(WSLOG_INFO, "%s %d POST %s NOTMOD", srci_get_client_ip(ri), z, url);
+				return strdup("object immutable - not modified");
+				break;
+			case 417:
+				return strdup("redis reply error");
+				break;
+			case 503:
+				return strdup("service unavailable");
+				break;
+			default:
+				return strdup("internal server error");
+		}
+	}
+
+	srci_set_return_code(ri, MHD_HTTP_OK);
+	log_add(WSLOG_INFO, "%s %d POST %s", srci_get_client_ip(ri), MHD_HTTP_OK, url);
+	return strdup("ok");
+}
+
+// A streamed upload is appended to a temporary key, post() moves it into place
+// The hash tag keeps the temporary key on the same cluster node/shard as the object
+// A stalled upload never reaches post(), so redis drops its temporary key after WSSTREAM_TTL seconds
+#define WSSTREAM_TTL "3600"
+typedef struct {
+	char *tmp;
+} wsstream_t;
+
+static unsigned long g_stream_seq = 0;
+
+// Validate (and forward) each chunk of an upload as it arrives
+// return SR_UPLOAD_BUFFER to let searest keep the chunk for post()
+// return SR_UPLOAD_CONSUMED once the chunk is in redis
+// return an HTTP status to reject the upload
+int upload_store(char *url, int urllen, void *sri_info, const char *data, size_t len, void *sri_user_data, void *node_user_data)
+{
+	int first = 0;
+	size_t tmplen;
+	char *hash;
+	const char *argv[5];
+	size_t argvlen[5];
+	srci_t *ri = (srci_t *)sri_info;
+	wsrt_t *rt = (wsrt_t *)sri_user_data;
+	wsstream_t *st;
 	redisReply *reply;
-	rai_t *rc = &rt->rc;
-
-	//Turn our uploaded data into a string with a finalizing NULL
-	datastr = calloc(1, datalen+1);
-	memcpy(datastr, dataptr, datalen);
-
-	//LOCK RAI if redis calls are in their own thread, using a shared context
-	if(rt->multithreaded) { rai_lock(rc); }
-	if((rt->expiration) && (rt->immutable)) {
-		reply = redisCommand(rc->c, "SET %s %s EX %ld NX", hash, datastr, rt->expiration);
-	} else if(rt->expiration) {
-		reply = redisCommand(rc->c, "SET %s %s EX %ld", hash, datastr, rt->expiration);
-	} else if(rt->immutable) {
-		reply = redisCommand(rc->c, "SET %s %s NX", hash, datastr);
-	} else {
-		reply = redisCommand(rc->c, "SET %s %s", hash, datastr);
+
+	if(METHOD(ri) != METHOD_POST) { return SR_UPLOAD_BUFFER; }
+	if(Z85_validate((const unsigned char *)data, len)) { return MHD_HTTP_BAD_REQUEST; }
+	if(!rt->sfwd) { return SR_UPLOAD_BUFFER; }
+
+	st = srci_get_node_data(ri);
+	if(!st) {
+		hash = convert_hash(url, urllen);
+		if(!hash) { return MHD_HTTP_BAD_REQUEST; }
+		tmplen = strlen(hash) + 64;
+		st = srci_alloc(ri, sizeof(wsstream_t));
+		if(st) { st->tmp = srci_alloc(ri, tmplen); }
+		if(!st || !st->tmp) {
+			free(hash);
+			return MHD_HTTP_INTERNAL_SERVER_ERROR;
+		}
+		snprintf(st->tmp, tmplen, "{%s}:wstmp:%d:%lu", hash, (int)getpid(), __sync_fetch_and_add(&g_stream_seq, 1));
+		free(hash);
+		srci_set_node_data(ri, st);
+		first = 1;
 	}
 
+	// The first chunk creates the temporary key with its TTL in one command, so it is never left without one
+	argv[0] = first ? "SET" : "APPEND";	argvlen[0] = strlen(argv[0]);
+	argv[1] = st->tmp;		argvlen[1] = strlen(st->tmp);
+	argv[2] = data;			argvlen[2] = len;
+	argv[3] = "EX";			argvlen[3] = 2;
+	argv[4] = WSSTREAM_TTL;	argvlen[4] = strlen(WSSTREAM_TTL);
+	reply = ws_redis_argv(rt, st->tmp, first ? 5 : 3, argv, argvlen);
+	if(!reply) { return MHD_HTTP_SERVICE_UNAVAILABLE; }
+	if(reply->type == REDIS_REPLY_ERROR) {
+		freeReplyObject(reply);
+		return MHD_HTTP_INTERNAL_SERVER_ERROR;
+	}
+	freeReplyObject(reply);
+
+	return SR_UPLOAD_CONSUMED;
+}
+
+// Drop the temporary key of a streamed upload that will not be stored
+static void stream_discard(wsrt_t *rt, wsstream_t *st)
+{
+	redisReply *reply;
+
+	if(!st) { return; }
+	reply = ws_redis_key(rt, "UNLINK", st->tmp);
+	if(reply) { freeReplyObject(reply); }
+}
+
+// Move a streamed upload into place, with the same policy as our SET template
+static int do_redis_stream_done(wsrt_t *rt, wsstream_t *st, const char *hash)
+{
+	int err = 500;
+	char ex[32];
+	const char *keys[2];
+	const char *args[2];
+	redisReply *reply;
+
+	snprintf(ex, sizeof(ex), "%ld", rt->expiration);
+	keys[0] = st->tmp;
+	keys[1] = hash;
+	args[0] = ex;
+	args[1] = rt->immutable ? "1" : "0";
+
+	reply = ws_redis_script_keys(rt, WSSCRIPT_STREAMDONE, 2, keys, 2, args);
+	if(!reply) { return 503; }
+	if(reply->type == REDIS_REPLY_ERROR) { err = 417; }
+	if(reply->type == REDIS_REPLY_INTEGER) { err = (reply->integer == 1) ? 0 : 304; }
+	freeReplyObject(reply);
+
+	return err;
+}
+
+static inline void set_template_add(wsset_t *s, const char *arg)
+{
+	s->argv[s->argc] = arg;
+	s->argvlen[s->argc] = strlen(arg);
+	s->argc++;
+}
+
+// Build the SET command for our policy once, at startup
+// SET <key> <value> [EX <expiration>] [NX]
+void post_template_init(wsrt_t *rt)
+{
+	wsset_t *s = &rt->set;
+
+	memset(s, 0, sizeof(wsset_t));
+	set_template_add(s, "SET");
+	set_template_add(s, "");
+	set_template_add(s, "");
+	if(rt->expiration) {
+		snprintf(s->ex, sizeof(s->ex), "%ld", rt->expiration);
+		set_template_add(s, "EX");
+		set_template_add(s, s->ex);
+	}
+	if(rt->immutable) { set_template_add(s, "NX"); }
+}
+
+// Fill in the key and value of our SET template
+// The value is passed by length, straight from the upload buffer
+void set_template_fill(wsrt_t *rt, const char **argv, size_t *argvlen,
+const char *hash, const unsigned char *dataptr, size_t datalen)
+{
+	memcpy(argv, rt->set.argv, sizeof(rt->set.argv));
+	memcpy(argvlen, rt->set.argvlen, sizeof(rt->set.argvlen));
+	argv[1] = hash;
+	argvlen[1] = strlen(hash);
+	argv[2] = (const char *)dataptr;
+	argvlen[2] = datalen;
+}
+
+static int do_redis_post(wsrt_t *rt, const char *hash, const unsigned char *dataptr, size_t datalen)
+{
+	int err = 500;
+	const char *argv[WSSET_MAXARGS];
+	size_t argvlen[WSSET_MAXARGS];
+	redisReply *reply;
+
+	set_template_fill(rt, argv, argvlen, hash, dataptr, datalen);
+
+	reply = ws_redis_argv(rt, hash, rt->set.argc, argv, argvlen);
 	if(!reply) {
 		err = 503;
-		handle_redis_error(rc);
 	} else {
-		if(reply->type == REDIS_REPLY_ERROR) { err = 417; }
-		if(reply->type == REDIS_REPLY_NIL) { err = 304; }
-		if(reply->type == REDIS_REPLY_STATUS) {
-			if(strncmp("OK", reply->str, 2) == 0) { err = 0; }
-		}
+		err = post_reply_status(reply);
 		freeReplyObject(reply);
 	}
-	if(rt->multithreaded) { rai_unlock(rc); }
 
-	free(datastr);
 	return err;
 }
 
+// Called from the async event loop thread
+static void post_async_cb(redisAsyncContext *ac, void *r, void *privdata)
+{
+	int z = 503;
+	redisReply *reply = r;
+	wsasync_t *wa = privdata;
+
+	if(reply) { z = post_reply_status(reply); }
+	if(wa->rt->icaching && (z == 0)) { wsic_add(wa->rt->ic, wa->hash); }
+
+	srci_resume(wa->ri, post_respond(wa->url, wa->ri, z));
+	wsasync_del(wa);
+}
+
+// Issue the SET without blocking, the connection is suspended until post_async_cb()
+static char* post_async(wsreq_t *req, wsrt_t *rt, srci_t *ri, char *hash, const unsigned char *dataptr, size_t datalen)
+{
+	int z;
+	const char *argv[WSSET_MAXARGS];
+	size_t argvlen[WSSET_MAXARGS];
+	wsasync_t *wa;
+
+	wa = wsasync_new(rt, ri, req->url, hash);
+	if(!wa) {
+		free(hash);
+		return post_respond(req->url, ri, 500);
+	}
+
+	set_template_fill(rt, argv, argvlen, hash, dataptr, datalen);
+
+	srci_suspend(ri);
+	z = raia_command_argv(&rt->ra, &post_async_cb, wa, rt->set.argc, argv, argvlen);
+
+	if(z != REDIS_OK) {
+		wsasync_del(wa);
+		srci_resume(ri, post_respond(req->url, ri, 503));
+	}
+
+	return NULL;
+}
+
 static char* post(wsreq_t *req, wsrt_t *rt, srci_t *ri)
 {
 	int z;
 	const unsigned char *dataptr;
 	size_t datalen;
 	char *hash;
+	wsstream_t *st;
+
+	// A streamed upload may already be (partly) in redis
+	st = srci_get_node_data(ri);
+
+	// upload_store() rejected the upload while it arrived
+	z = srci_get_upload_status(ri);
+	if(z) {
+		stream_discard(rt, st);
+		if(z != MHD_HTTP_BAD_REQUEST) { return post_respond(req->url, ri, z); }
+		srci_set_return_code(ri, MHD_HTTP_BAD_REQUEST);
+		return strdup("malformed request - invalid Z85");
+	}
 
 	// Check the URL length
 	if(req->urllen != req->hashlen) {
+		stream_discard(rt, st);
 		srci_set_return_code(ri, MHD_HTTP_BAD_REQUEST);
 		return strdup("malformed request - invalid url");
 	}
@@ -202,16 +897,19 @@ static char* post(wsreq_t *req, wsrt_t *rt, srci_t *ri)
 	// Check the length of uploaded data
 	datalen = srci_get_post_data_size(ri);
 	if(datalen < 5) {
+		stream_discard(rt, st);
 		srci_set_return_code(ri, MHD_HTTP_BAD_REQUEST);
 		return strdup("malformed request - invalid length");
 	}
 
-	// Validate the uploaded data
+	// Validate the uploaded data, a streamed upload was validated chunk by chunk
 	dataptr = srci_get_post_data_ptr(ri);
-	z = Z85_validate(dataptr, datalen);
-	if(z) {
-		srci_set_return_code(ri, MHD_HTTP_BAD_REQUEST);
-		return strdup("malformed request - invalid Z85");
+	if(!rt->stream) {
+		z = Z85_validate(dataptr, datalen);
+		if(z) {
+			srci_set_return_code(ri, MHD_HTTP_BAD_REQUEST);
+			return strdup("malformed request - invalid Z85");
+		}
 	}
 
 #ifdef DEBUG
@@ -220,33 +918,18 @@ static char* post(wsreq_t *req, wsrt_t *rt, srci_t *ri)
 
 	hash = convert_hash(req->url, req->urllen);
 	if(!hash) {
+		stream_discard(rt, st);
 		srci_set_return_code(ri, MHD_HTTP_BAD_REQUEST);
 		return strdup("malformed request - invalid token");
 	}
 
-	z = do_redis_post(rt, hash, dataptr, datalen);
-	free(hash);
-	if(z) {
-		srci_set_return_code(ri, z);
-		switch(z) {
-			case 304:
-				log_add(WSLOG_INFO, "%s %d POST %s NOTMOD", srci_get_client_ip(ri), z, req->url);
-				return strdup("object immutable - not modified");
-				break;
-			case 417:
-				return strdup("redis reply error");
-				break;
-			case 503:
-				return strdup("service unavailable");
-				break;
-			default:
-				return strdup("internal server error");
-		}
-	}
+	if(rt->async) { return post_async(req, rt, ri, hash, dataptr, datalen); }
 
-	srci_set_return_code(ri, MHD_HTTP_OK);
-	log_add(WSLOG_INFO, "%s %d POST %s", srci_get_client_ip(ri), MHD_HTTP_OK, req->url);
-	return strdup("ok");
+	if(st) { z = do_redis_stream_done(rt, st, hash); }
+	else { z = do_redis_post(rt, hash, dataptr, datalen); }
+	if(rt->icaching && (z == 0)) { wsic_add(rt->ic, hash); }
+	free(hash);
+	return post_respond(req->url, ri, z);
 }
 
 static inline char* shutdownmsg(srci_t *ri)
@@ -255,6 +938,98 @@ static inline char* shutdownmsg(srci_t *ri)
 	return strdup("service unavailable: shutting down");
 }
 
+// return 1 if the object is known to exist
+// A redis error lets the upload through, post() will report it
+// PTTL tells us both if the object exists and how long the cache may remember it
+// With --async the header phase must not block on redis, only the cache is asked
+static int object_exists(wsrt_t *rt, const char *hash)
+{
+	long long left = -2;
+	redisReply *reply;
+
+	if(rt->icaching && wsic_has(rt->ic, hash)) { return 1; }
+	if(rt->async) { return 0; }
+
+	reply = ws_redis_key(rt, "PTTL", hash);
+	if(!reply) { return 0; }
+	if(reply->type == REDIS_REPLY_INTEGER) { left = reply->integer; }
+	freeReplyObject(reply);
+
+	if(left == -2) { return 0; }	// PTTL of a missing key
+	if(rt->icaching) { wsic_add_pttl(rt->ic, hash, left); }
+	return 1;
+}
+
+// Reject a bad POST from its headers, before the client sends the body
+// return NULL to let the upload through, post() does the rest of the checks
+static char* precheck(char *url, int urllen, int hashlen, srci_t *ri, wsrt_t *rt)
+{
+	int i, z;
+	char *hash;
+
+	if(METHOD(ri) != METHOD_POST) { return NULL; }
+	if(shutting_down()) { return shutdownmsg(ri); }
+
+	if(urllen != hashlen) {
+		srci_set_return_code(ri, MHD_HTTP_BAD_REQUEST);
+		return strdup("malformed request - invalid url");
+	}
+
+	for(i=0; i<urllen; i++) {
+		if(!isxdigit(url[i])) {
+			srci_set_return_code(ri, MHD_HTTP_BAD_REQUEST);
+			return strdup("malformed request - invalid token");
+		}
+	}
+
+	// A chunked upload has no Content-Length, its size is checked as it arrives
+	if(!ri->chunked && (ri->content_length < 5)) {
+		srci_set_return_code(ri, MHD_HTTP_BAD_REQUEST);
+		return strdup("malformed request - invalid length");
+	}
+
+	// An immutable object that already exists would only get its 304 after the upload
+	if(rt->immutable) {
+		hash = convert_hash(url, urllen);
+		if(!hash) { return NULL; }
+		z = object_exists(rt, hash);
+		free(hash);
+		if(z) { return post_respond(url, ri, 304); }
+	}
+
+	return NULL;
+}
+
+char* pre128(char *url, int urllen, srci_t *ri, void *sri_user_data, void *node_user_data)
+{
+	return precheck(url, urllen, HASHLEN128, ri, (wsrt_t *)sri_user_data);
+}
+
+char* pre160(char *url, int urllen, srci_t *ri, void *sri_user_data, void *node_user_data)
+{
+	return precheck(url, urllen, HASHLEN160, ri, (wsrt_t *)sri_user_data);
+}
+
+char* pre224(char *url, int urllen, srci_t *ri, void *sri_user_data, void *node_user_data)
+{
+	return precheck(url, urllen, HASHLEN224, ri, (wsrt_t *)sri_user_data);
+}
+
+char* pre256(char *url, int urllen, srci_t *ri, void *sri_user_data, void *node_user_data)
+{
+	return precheck(url, urllen, HASHLEN256, ri, (wsrt_t *)sri_user_data);
+}
+
+char* pre384(char *url, int urllen, srci_t *ri, void *sri_user_data, void *node_user_data)
+{
+	return precheck(url, urllen, HASHLEN384, ri, (wsrt_t *)sri_user_data);
+}
+
+char* pre512(char *url, int urllen, srci_t *ri, void *sri_user_data, void *node_user_data)
+{
+	return precheck(url, urllen, HASHLEN512, ri, (wsrt_t *)sri_user_data);
+}
+
 char* node128(char *url, int urllen, srci_t *ri, void *sri_user_data, void *node_user_data)
 {
 	wsreq_t req;
@@ -276,6 +1051,9 @@ char* node128(char *url, int urllen, srci_t *ri, void *sri_user_data, void *node
 		case METHOD_POST:
 			page = post(&req, rt, ri);
 			break;
+		case METHOD_HEAD:
+			page = head(&req, rt, ri);
+			break;
 		/*case METHOD_DEL:
 			break;*/
 		default:
@@ -309,6 +1087,9 @@ char* node160(char *url, int urllen, srci_t *ri, void *sri_user_data, void *node
 		case METHOD_POST:
 			page = post(&req, rt, ri);
 			break;
+		case METHOD_HEAD:
+			page = head(&req, rt, ri);
+			break;
 		/*case METHOD_DEL:
 			break;*/
 		default:
@@ -342,6 +1123,9 @@ char* node224(char *url, int urllen, srci_t *ri, void *sri_user_data, void *node
 		case METHOD_POST:
 			page = post(&req, rt, ri);
 			break;
+		case METHOD_HEAD:
+			page = head(&req, rt, ri);
+			break;
 		/*case METHOD_DEL:
 			break;*/
 		default:
@@ -375,6 +1159,9 @@ char* node256(char *url, int urllen, srci_t *ri, void *sri_user_data, void *node
 		case METHOD_POST:
 			page = post(&req, rt, ri);
 			break;
+		case METHOD_HEAD:
+			page = head(&req, rt, ri);
+			break;
 		/*case METHOD_DEL:
 			break;*/
 		default:
@@ -408,6 +1195,9 @@ char* node384(char *url, int urllen, srci_t *ri, void *sri_user_data, void *node
 		case METHOD_POST:
 			page = post(&req, rt, ri);
 			break;
+		case METHOD_HEAD:
+			page = head(&req, rt, ri);
+			break;
 		/*case METHOD_DEL:
 			break;*/
 		default:
@@ -441,6 +1231,9 @@ char* node512(char *url, int urllen, srci_t *ri, void *sri_user_data, void *node
 		case METHOD_POST:
 			page = post(&req, rt, ri);
 			break;
+		case METHOD_HEAD:
+			page = head(&req, rt, ri);
+			break;
 		/*case METHOD_DEL:
 			break;*/
 		default:
@@ -21,29 +21,134 @@
 
 #include "searest.h"
 #include "rai.h"
+#include "rai_async.h"
+#include "rai_batch.h"
+#include "rai_cluster.h"
+#include "rai_shard.h"
+#include "rai_replica.h"
+
+#define WS_MAX_DAEMONS (64)
+#define WS_MAX_LISTENERS (SR_MAX_LISTENERS-1)
+
+// Remaining lifetime of an object in seconds, answered to HEAD
+#define WSHDRTTL "X-Webstore-TTL"
 
 typedef struct {
 	char *http_ip;
 	unsigned short http_port;
+
+	// Every --listen, on top of http_ip:http_port
+	char *ldests[WS_MAX_LISTENERS];	// IPv4, IPv6 or a unix socket path
+	unsigned short lports[WS_MAX_LISTENERS];
+	int lcount;
+
 	int use_threads;
+	int tpool;				// UHD epoll thread pool size (io_uring rings)
+	int uring;				// io_uring engine
+	int daemons;			// UHD daemons sharing the port
+	int rpool;				// Redis Pool Size
+	int use_async;			// Non-blocking Redis
+	long rwindow;			// Redis Batch Window (usec)
+	int rbatch;				// Redis Batch Max Ops
+	int use_cluster;		// Redis Cluster
 	long max_post_data_size;
 	char *certfile;
 	char *keyfile;
 
 	char *rdest;			// Redis Dest
 	unsigned short rport;	// Redis Port
+
+	// Every --rsock/--rtcp, more than one means sharding
+	char *rdests[RAIS_MAX_SHARDS];
+	unsigned short rports[RAIS_MAX_SHARDS];
+	int rcount;
+
+	// Every --rreplica, GETs are sent here
+	char *rrdests[RAIR_MAX_REPLICAS];
+	unsigned short rrports[RAIR_MAX_REPLICAS];
+	int rrcount;
+	int rrpolicy;			// Replica Selection
+	int rryw;				// Read Your Writes
+	long rtimeout;			// Redis Command Timeout (ms)
+	int rbreaker;			// Redis Failures before failing fast
+	int stream;				// Validate uploads chunk by chunk
+	int sfwd;				// Forward upload chunks to redis
+	long sget;				// GET window size (bytes), 0 sends objects whole
 } srv_opts_t;
 
+// Prebuilt SET command for our EXPIRATION/IMMUTABLE policy
+// argv[1] (key) and argv[2] (value) are filled in per request
+#define WSSET_MAXARGS (6)
+typedef struct {
+	int argc;
+	const char *argv[WSSET_MAXARGS];
+	size_t argvlen[WSSET_MAXARGS];
+	char ex[32];
+} wsset_t;
+
+// One command of a pipeline, see ws_redis_pipeline()
+typedef struct {
+	const char *key;	// the key the command operates on, routes it in a cluster
+	int argc;
+	const char *argv[WSSET_MAXARGS];
+	size_t argvlen[WSSET_MAXARGS];
+	redisReply *reply;
+} wscmd_t;
+
+// Server-side scripts, loaded at startup and called by SHA1
+#define WSSCRIPT_GETBURN	(0)
+#define WSSCRIPT_RATELIMIT	(1)
+#define WSSCRIPT_STREAMDONE	(2)
+#define WSSCRIPT_MGETBURN	(3)
+#define WSSCRIPT_COUNT		(4)
+typedef struct {
+	const char *src;
+	char sha[41];
+} wsscript_t;
+
+// Tokens known to exist in redis, so that a repeated IMMUTABLE POST is answered locally
+// Direct mapped, a slot holds the last token that hashed to it
+#define WSIC_SLOTS (4096)
+typedef struct {
+	char token[128+1];
+	long long until;		// ms
+} wsic_entry_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	long ttl;				// ms
+	wsic_entry_t *slots;
+} wsic_t;
+
 // WebStore Runtime data
 typedef struct {
-	rai_t rc;	//Redis Context
+	raip_t rp;	//Redis Context Pool
+	raia_t ra;	//Redis Async Context
+	int async;
+	raib_t rb;	//Redis Batcher
+	int batching;
+	raic_t rc;	//Redis Cluster
+	int clustered;
+	rais_t rs;	//Redis Shards
+	int sharded;
+	rair_t rr;	//Redis Read Replicas
+	int replicas;
+	int ryw;
+	raicb_t cb;	//Redis Circuit Breaker
 	int multithreaded;
+	int stream;
+	int sfwd;
+	long sget;
 	int reqperiod;
 	long reqcount;
 	long max_post_data_size;
 	long expiration;
 	int immutable;
 	int bar;
+	wsic_t *ic;	//Immutable Cache (shared by every daemon)
+	int icaching;
+	wsset_t set;
+	wsscript_t scripts[WSSCRIPT_COUNT];
 } wsrt_t;
 
 // WebStore Request Info
@@ -57,15 +162,44 @@ typedef struct {
 // Found in webstore.c
 int shutting_down(void);
 void handle_redis_error(rai_t *);
+void handle_redis_async_error(const char *);
 
 // Found in webstore_conn.c
 int allow_ip(wsrt_t *, char *);
 
+// Found in webstore_cache.c
+int wsic_init(wsic_t *, long);
+int wsic_has(wsic_t *, const char *);
+void wsic_add(wsic_t *, const char *);
+void wsic_add_pttl(wsic_t *, const char *, long long);
+void wsic_del(wsic_t *, const char *);
+void wsic_free(wsic_t *);
+
+// Found in webstore_redis.c
+redisReply* ws_redis_argv(wsrt_t *, const char *, int, const char **, const size_t *);
+redisReply* ws_redis_all(wsrt_t *, int, const char **, const size_t *);
+redisReply* ws_redis_read(wsrt_t *, const char *);
+redisReply* ws_redis_key(wsrt_t *, const char *, const char *);
+int ws_redis_scripts_load(wsrt_t *);
+redisReply* ws_redis_script(wsrt_t *, int, const char *, int, const char **);
+redisReply* ws_redis_script_keys(wsrt_t *, int, int, const char **, int, const char **);
+int ws_redis_backend(wsrt_t *, const char *);
+void ws_redis_pipeline(wsrt_t *, const char *, int, wscmd_t *);
+void ws_redis_read_pipeline(wsrt_t *, const char *, int, wscmd_t *);
+redisReply* ws_redis_read_argv(wsrt_t *, const char *, int, const char **, const size_t *);
+
+// Found in webstore_batch.c
+char* nodebatch(char *, int, srci_t *, void *, void *);
+
 // Found in webstore_uhd.c
 void webstore_start(srv_opts_t *);
 void webstore_stop(void);
 
 // Found in webstore_node.c
+int Z85_validate(const unsigned char *, size_t);
+int post_reply_status(redisReply *);
+void post_template_init(wsrt_t *);
+void set_template_fill(wsrt_t *, const char **, size_t *, const char *, const unsigned char *, size_t);
 char* node128(char *, int, srci_t *, void *, void *);
 char* node160(char *, int, srci_t *, void *, void *);
 char* node224(char *, int, srci_t *, void *, void *);
@@ -73,5 +207,12 @@ char* node256(char *, int, srci_t *, void *, void *);
 char* node384(char *, int, srci_t *, void *, void *);
 char* node512(char *, int, srci_t *, void *, void *);
 char* nodecfg(char *, int, srci_t *, void *, void *);
+char* pre128(char *, int, srci_t *, void *, void *);
+char* pre160(char *, int, srci_t *, void *, void *);
+char* pre224(char *, int, srci_t *, void *, void *);
+char* pre256(char *, int, srci_t *, void *, void *);
+char* pre384(char *, int, srci_t *, void *, void *);
+char* pre512(char *, int, srci_t *, void *, void *);
+int upload_store(char *, int, void *, const char *, size_t, void *, void *);
 
 #endif
@@ -0,0 +1,380 @@
+/*
+	webstore is a web-based arbitrary data storage service that accepts z85 encoded data 
+	Copyright (C) 2021 Brett Kuskie <fullaxx@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; version 2 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "webstore_ops.h"
+#include "webstore_log.h"
+
+// Feed the circuit breaker
+static inline void ws_redis_track(wsrt_t *rt, redisReply *reply)
+{
+	if(reply) { raicb_success(&rt->cb); return; }
+	if(raicb_failure(&rt->cb)) {
+		log_add(WSLOG_ERR, "redis circuit breaker open, failing fast for %d ms", rt->cb.cooldown);
+	}
+}
+
+// Run one blocking command on redis, through the batcher when it is enabled
+// key is the key the command operates on, used to pick a cluster node
+// return NULL on a redis error (it has already been handled)
+// The reply must be freed with freeReplyObject()
+redisReply* ws_redis_argv(wsrt_t *rt, const char *key, int argc, const char **argv, const size_t *argvlen)
+{
+	redisReply *reply;
+	raip_t *pool = &rt->rp;
+	rai_t *rc;
+
+	// Fail fast while redis is down
+	if(!raicb_allow(&rt->cb)) { return NULL; }
+
+	if(rt->clustered) { reply = raic_command_argv(&rt->rc, key, argc, argv, argvlen); }
+	else if(rt->batching) { reply = raib_command_argv(&rt->rb, argc, argv, argvlen); }
+	else {
+		if(rt->sharded) { pool = rais_pick(&rt->rs, key); }
+
+		//Checkout a context from the pool, locking it for our exclusive use
+		rc = raip_checkout(pool);
+		reply = redisCommandArgv(rc->c, argc, argv, argvlen);
+		if(!reply) { handle_redis_error(rc); }
+		raip_checkin(pool, rc);
+	}
+
+	ws_redis_track(rt, reply);
+	return reply;
+}
+
+// Run one keyless command on every redis node we know of
+// return the last reply, NULL on a redis error (it has already been handled)
+redisReply* ws_redis_all(wsrt_t *rt, int argc, const char **argv, const size_t *argvlen)
+{
+	int i, count = 1;
+	redisReply *reply = NULL;
+	raip_t *pool = &rt->rp;
+	rai_t *rc;
+
+	if(rt->clustered) { return raic_command_all(&rt->rc, argc, argv, argvlen); }
+	if(rt->sharded) { count = rt->rs.count; }
+
+	for(i=0; i<count; i++) {
+		if(reply) { freeReplyObject(reply); }
+		if(rt->sharded) { pool = &rt->rs.pools[i]; }
+		rc = raip_checkout(pool);
+		reply = redisCommandArgv(rc->c, argc, argv, argvlen);
+		if(!reply) { handle_redis_error(rc); }
+		raip_checkin(pool, rc);
+		if(!reply) { return NULL; }
+	}
+
+	return reply;
+}
+
+// Run one read only command on a read replica when we have them, on the primary otherwise
+// Read your writes is up to the caller, a replica may not have the object yet
+// return NULL on a redis error (it has already been handled)
+redisReply* ws_redis_read_argv(wsrt_t *rt, const char *key, int argc, const char **argv, const size_t *argvlen)
+{
+	int n;
+	redisReply *reply;
+	rai_t *rc;
+
+	if(!rt->replicas) { return ws_redis_argv(rt, key, argc, argv, argvlen); }
+	if(!raicb_allow(&rt->cb)) { return NULL; }
+
+	rc = rair_checkout(&rt->rr, &n);
+	reply = redisCommandArgv(rc->c, argc, argv, argvlen);
+	if(!reply) { handle_redis_error(rc); }
+	rair_checkin(&rt->rr, n, rc);
+	ws_redis_track(rt, reply);
+
+	return reply;
+}
+
+// GET key from a read replica when we have them
+// With read-your-writes, a replica miss is retried on the primary (the SET may not have replicated yet)
+// return NULL on a redis error (it has already been handled)
+redisReply* ws_redis_read(wsrt_t *rt, const char *key)
+{
+	const char *argv[2];
+	size_t argvlen[2];
+	redisReply *reply;
+
+	if(!rt->replicas) { return ws_redis_key(rt, "GET", key); }
+
+	argv[0] = "GET";	argvlen[0] = 3;
+	argv[1] = key;		argvlen[1] = strlen(key);
+	reply = ws_redis_read_argv(rt, key, 2, argv, argvlen);
+
+	if(reply && (reply->type == REDIS_REPLY_NIL) && rt->ryw) {
+		freeReplyObject(reply);
+		reply = ws_redis_key(rt, "GET", key);
+	}
+
+	return reply;
+}
+
+// Same as ws_redis_argv() for commands of the form: CMD <key>
+redisReply* ws_redis_key(wsrt_t *rt, const char *cmd, const char *key)
+{
+	const char *argv[2];
+	size_t argvlen[2];
+
+	argv[0] = cmd;		argvlen[0] = strlen(cmd);
+	argv[1] = key;		argvlen[1] = strlen(key);
+
+	return ws_redis_argv(rt, key, 2, argv, argvlen);
+}
+
+// Burn After Reading in one round trip
+// KEYS[1] = object
+// Returns the object (or nil) and UNLINKs it, so that redis can free large values lazily
+static const char *g_lua_getburn =
+	"local v = redis.call('GET', KEYS[1])\n"
+	"if v then redis.call('UNLINK', KEYS[1]) end\n"
+	"return v\n";
+
+// Burn After Reading for a batch of objects in one round trip
+// KEYS = objects, all on one backend
+// Returns the objects (or nil) in KEYS order and UNLINKs the ones it found
+static const char *g_lua_mgetburn =
+	"local r = {}\n"
+	"for i, k in ipairs(KEYS) do\n"
+	"  local v = redis.call('GET', k)\n"
+	"  if v then redis.call('UNLINK', k) r[i] = v else r[i] = false end\n"
+	"end\n"
+	"return r\n";
+
+// Per IP connection limiting in one round trip
+// KEYS[1] = IPS:<ip>, ARGV[1] = reqperiod, ARGV[2] = reqcount
+// Returns the new count if the connection is allowed, -(count+1) if it is denied
+static const char *g_lua_ratelimit =
+	"local c = redis.call('GET', KEYS[1])\n"
+	"if not c then\n"
+	"  redis.call('SET', KEYS[1], 1, 'EX', ARGV[1])\n"
+	"  return 1\n"
+	"end\n"
+	"c = tonumber(c)\n"
+	"if c < tonumber(ARGV[2]) then return redis.call('INCR', KEYS[1]) end\n"
+	"return -(c+1)\n";
+
+// Finish a streamed upload in one round trip
+// KEYS[1] = temporary key, KEYS[2] = object, ARGV[1] = expiration, ARGV[2] = immutable
+// Returns 1 if the object was stored, 0 if it is immutable and already exists
+static const char *g_lua_streamdone =
+	"if ARGV[2] == '1' and redis.call('EXISTS', KEYS[2]) == 1 then\n"
+	"  redis.call('UNLINK', KEYS[1])\n"
+	"  return 0\n"
+	"end\n"
+	"redis.call('RENAME', KEYS[1], KEYS[2])\n"
+	"if tonumber(ARGV[1]) > 0 then redis.call('EXPIRE', KEYS[2], ARGV[1])\n"
+	"else redis.call('PERSIST', KEYS[2]) end\n"
+	"return 1\n";
+
+// SCRIPT LOAD all of our scripts and save their SHA1
+// return 0 on success
+// return the script id + 1 if a script failed to load
+int ws_redis_scripts_load(wsrt_t *rt)
+{
+	int i;
+	const char *argv[3];
+	size_t argvlen[3];
+	redisReply *reply;
+
+	rt->scripts[WSSCRIPT_GETBURN].src = g_lua_getburn;
+	rt->scripts[WSSCRIPT_RATELIMIT].src = g_lua_ratelimit;
+	rt->scripts[WSSCRIPT_STREAMDONE].src = g_lua_streamdone;
+	rt->scripts[WSSCRIPT_MGETBURN].src = g_lua_mgetburn;
+
+	for(i=0; i<WSSCRIPT_COUNT; i++) {
+		argv[0] = "SCRIPT";					argvlen[0] = 6;
+		argv[1] = "LOAD";					argvlen[1] = 4;
+		argv[2] = rt->scripts[i].src;		argvlen[2] = strlen(rt->scripts[i].src);
+		reply = ws_redis_all(rt, 3, argv, argvlen);
+		if(!reply) { return i+1; }
+		if((reply->type != REDIS_REPLY_STRING) || (reply->len != 40)) {
+			freeReplyObject(reply);
+			return i+1;
+		}
+		memcpy(rt->scripts[i].sha, reply->str, 40);
+		rt->scripts[i].sha[40] = 0;
+		freeReplyObject(reply);
+	}
+
+	return 0;
+}
+
+static inline int is_noscript(redisReply *reply)
+{
+	if(reply->type != REDIS_REPLY_ERROR) { return 0; }
+	return (strncmp(reply->str, "NOSCRIPT", 8) == 0);
+}
+
+// Call one of our scripts with a single key and up to 4 string arguments
+// return NULL on a redis error (it has already been handled)
+redisReply* ws_redis_script(wsrt_t *rt, int id, const char *key, int argc, const char **args)
+{
+	return ws_redis_script_keys(rt, id, 1, &key, argc, args);
+}
+
+// Call one of our scripts with any number of keys and up to 4 string arguments
+// Every key must live on the same node/shard as the first one (see ws_redis_backend())
+// If redis has lost the script (restart, SCRIPT FLUSH) fall back to EVAL, which reloads it
+// return NULL on a redis error (it has already been handled)
+redisReply* ws_redis_script_keys(wsrt_t *rt, int id, int keyc, const char **keys, int argc, const char **args)
+{
+	int i, n;
+	char numkeys[16];
+	const char **argv;
+	size_t *argvlen;
+	redisReply *reply;
+
+	if((keyc < 1) || (argc > 4)) { return NULL; }
+	snprintf(numkeys, sizeof(numkeys), "%d", keyc);
+
+	argv = malloc((3+keyc+argc) * sizeof(char *));
+	argvlen = malloc((3+keyc+argc) * sizeof(size_t));
+	if(!argv || !argvlen) {
+		free(argv);
+		free(argvlen);
+		return NULL;
+	}
+
+	argv[0] = "EVALSHA";			argvlen[0] = 7;
+	argv[1] = rt->scripts[id].sha;	argvlen[1] = 40;
+	argv[2] = numkeys;				argvlen[2] = strlen(numkeys);
+	for(n=3, i=0; i<keyc; i++, n++) {
+		argv[n] = keys[i];
+		argvlen[n] = strlen(keys[i]);
+	}
+	for(i=0; i<argc; i++, n++) {
+		argv[n] = args[i];
+		argvlen[n] = strlen(args[i]);
+	}
+
+	reply = ws_redis_argv(rt, keys[0], n, argv, argvlen);
+	if(reply && is_noscript(reply)) {
+		freeReplyObject(reply);
+		argv[0] = "EVAL";					argvlen[0] = 4;
+		argv[1] = rt->scripts[id].src;		argvlen[1] = strlen(rt->scripts[id].src);
+		reply = ws_redis_argv(rt, keys[0], n, argv, argvlen);
+	}
+
+	free(argv);
+	free(argvlen);
+	return reply;
+}
+
+// Which backend (cluster master, shard) key lives on
+// Keys that share a backend can share a pipeline
+// In a cluster, multi-key commands also need the keys to share a slot (see raic_keyslot())
+int ws_redis_backend(wsrt_t *rt, const char *key)
+{
+	if(rt->clustered) { return raic_key_node(&rt->rc, key); }
+	if(rt->sharded) { return rais_pick(&rt->rs, key) - &rt->rs.pools[0]; }
+	return 0;
+}
+
+// Send n commands on one locked context and read every reply
+static void pipeline_rc(rai_t *rc, int n, wscmd_t *cmds)
+{
+	int i, sent = 0;
+
+	for(i=0; i<n; i++) {
+		if(redisAppendCommandArgv(rc->c, cmds[i].argc, cmds[i].argv, cmds[i].argvlen) != REDIS_OK) { break; }
+		sent++;
+	}
+	for(i=0; i<sent; i++) {
+		if(redisGetReply(rc->c, (void **)&cmds[i].reply) != REDIS_OK) {
+			cmds[i].reply = NULL;
+			break;
+		}
+	}
+	if(rc->c->err) { handle_redis_error(rc); }
+}
+
+// Pipeline n commands to the backend that owns key, in one round trip
+// Every command must operate on a key of the same backend (see ws_redis_backend())
+// A command left with a NULL reply did not get an answer (the error has already been handled)
+void ws_redis_pipeline(wsrt_t *rt, const char *key, int n, wscmd_t *cmds)
+{
+	int i;
+	int *argc;
+	const char **keys, ***argv;
+	const size_t **argvlen;
+	redisReply **replies;
+	raip_t *pool = &rt->rp;
+	rai_t *rc;
+
+	for(i=0; i<n; i++) { cmds[i].reply = NULL; }
+	if(n < 1) { return; }
+
+	// Fail fast while redis is down
+	if(!raicb_allow(&rt->cb)) { return; }
+
+	if(rt->clustered) {
+		keys = malloc(n * sizeof(char *));
+		argc = malloc(n * sizeof(int));
+		argv = malloc(n * sizeof(char **));
+		argvlen = malloc(n * sizeof(size_t *));
+		replies = malloc(n * sizeof(redisReply *));
+		if(keys && argc && argv && argvlen && replies) {
+			for(i=0; i<n; i++) {
+				keys[i] = cmds[i].key ? cmds[i].key : key;
+				argc[i] = cmds[i].argc;
+				argv[i] = cmds[i].argv;
+				argvlen[i] = cmds[i].argvlen;
+			}
+			raic_pipeline_argv(&rt->rc, n, keys, argc, argv, argvlen, replies);
+			for(i=0; i<n; i++) { cmds[i].reply = replies[i]; }
+		}
+		free(keys);
+		free(argc);
+		free(argv);
+		free(argvlen);
+		free(replies);
+	} else {
+		if(rt->sharded) { pool = rais_pick(&rt->rs, key); }
+		rc = raip_checkout(pool);
+		pipeline_rc(rc, n, cmds);
+		raip_checkin(pool, rc);
+	}
+
+	ws_redis_track(rt, cmds[n-1].reply);
+}
+
+// Same as ws_redis_pipeline() on a read replica when we have them
+// Read your writes is up to the caller, a replica may not have the object yet
+void ws_redis_read_pipeline(wsrt_t *rt, const char *key, int n, wscmd_t *cmds)
+{
+	int i, r;
+	rai_t *rc;
+
+	if(!rt->replicas) { ws_redis_pipeline(rt, key, n, cmds); return; }
+
+	for(i=0; i<n; i++) { cmds[i].reply = NULL; }
+	if(n < 1) { return; }
+	if(!raicb_allow(&rt->cb)) { return; }
+
+	rc = rair_checkout(&rt->rr, &r);
+	pipeline_rc(rc, n, cmds);
+	rair_checkin(&rt->rr, r, rc);
+
+	ws_redis_track(rt, cmds[n-1].reply);
+}
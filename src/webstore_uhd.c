@@ -25,33 +25,52 @@
 #include "webstore_log.h"
 #include "futils.h"
 
-sri_t *g_srv = NULL;
-wsrt_t g_rt;
+sri_t *g_srv[WS_MAX_DAEMONS];
+wsrt_t g_rt[WS_MAX_DAEMONS];
+int g_daemons = 0;
+
+// One immutable cache for the whole process, a BAR burn on any daemon must evict the token for all
+static wsic_t g_ic;
 
 #ifdef SRNODECHRONOMETRY
 #include "chronometry.h"
+// Average over every daemon that has served this node
+static long avg_duration(char *node)
+{
+	int i, n = 0;
+	long avg, sum = 0;
+
+	for(i=0; i<g_daemons; i++) {
+		if(!g_srv[i]) { continue; }
+		avg = searest_node_get_avg_duration(g_srv[i], node);
+		if(avg > 0) { sum += avg; n++; }
+	}
+
+	return (n > 0) ? (sum / n) : 0;
+}
+
 void print_avg_nodecb_time(void)
 {
 	long avg;
 
-	if(!g_srv) { return; }
+	if(g_daemons < 1) { return; }
 
-	avg = searest_node_get_avg_duration(g_srv, "/store/128/");
+	avg = avg_duration("/store/128/");
 	if(avg > 0) printf("%3s: %ldns\n", "128", avg);
 
-	avg = searest_node_get_avg_duration(g_srv, "/store/160/");
+	avg = avg_duration("/store/160/");
 	if(avg > 0) printf("%3s: %ldns\n", "160", avg);
 
-	avg = searest_node_get_avg_duration(g_srv, "/store/224/");
+	avg = avg_duration("/store/224/");
 	if(avg > 0) printf("%3s: %ldns\n", "224", avg);
 
-	avg = searest_node_get_avg_duration(g_srv, "/store/256/");
+	avg = avg_duration("/store/256/");
 	if(avg > 0) printf("%3s: %ldns\n", "256", avg);
 
-	avg = searest_node_get_avg_duration(g_srv, "/store/384/");
+	avg = avg_duration("/store/384/");
 	if(avg > 0) printf("%3s: %ldns\n", "384", avg);
 
-	avg = searest_node_get_avg_duration(g_srv, "/store/512/");
+	avg = avg_duration("/store/512/");
 	if(avg > 0) printf("%3s: %ldns\n", "512", avg);
 }
 #endif
@@ -65,6 +84,7 @@ static int ws_addr_check(char *inc_ip, void *sri_user_data)
 
 	// Blindly accept w/o logging localhost
 	if(strcmp(inc_ip, "127.0.0.1") == 0) { return SR_IP_ACCEPT; }
+	if(strcmp(inc_ip, "::1") == 0) { return SR_IP_ACCEPT; }
 
 	z = allow_ip(lrt, inc_ip);
 	if(z == 0) { return SR_IP_DENY; }
@@ -72,7 +92,7 @@ static int ws_addr_check(char *inc_ip, void *sri_user_data)
 	return SR_IP_ACCEPT;
 }
 
-static void activate_https(srv_opts_t *so)
+static void activate_https(sri_t *srv, srv_opts_t *so)
 {
 	char *cert, *key;
 
@@ -80,79 +100,284 @@ static void activate_https(srv_opts_t *so)
 	if(!cert) { exit(EXIT_FAILURE); }
 	key = get_file(so->keyfile);
 	if(!key) { exit(EXIT_FAILURE); }
-	searest_set_https_cert(g_srv, cert);
-	searest_set_https_key(g_srv, key);
+	searest_set_https_cert(srv, cert);
+	searest_set_https_key(srv, key);
 	free(cert);
 	free(key);
 }
 
-void webstore_start(srv_opts_t *so)
+// One daemon, with its own redis connections
+// n is the index of this daemon
+static sri_t* ws_instance_start(srv_opts_t *so, wsrt_t *rt, int n)
 {
-	int z;
+	int i, z;
+	long ttl;
+	sri_t *srv;
 
 	// Connect to Redis
-	memset(&g_rt, 0, sizeof(wsrt_t));
-	g_rt.multithreaded = so->use_threads;
-	z = rai_connect(&g_rt.rc, so->rdest, so->rport);
+	memset(rt, 0, sizeof(wsrt_t));
+	rt->multithreaded = (so->use_threads || (so->tpool > 1));
+	if(so->use_cluster) {
+		// rdest:rport is only a seed, every master gets its own pool
+		z = raic_connect(&rt->rc, so->rdest, so->rport, so->rpool, &handle_redis_error);
+		if(z) {
+			fprintf(stderr, "raic_connect(%s:%u) failed! (%d)\n", so->rdest, so->rport, z);
+			exit(EXIT_FAILURE);
+		}
+		rt->clustered = 1;
+	} else if(so->rcount > 1) {
+		// Independent redis instances, keys are placed by consistent hashing
+		for(z=0, i=0; (z==0) && (i<so->rcount); i++) {
+			z = rais_add(&rt->rs, so->rdests[i], so->rports[i], so->rpool);
+			if(z) {
+				if(so->rports[i]) { fprintf(stderr, "Failed to connect to %s:%u!\n", so->rdests[i], so->rports[i]); }
+				else { fprintf(stderr, "Failed to connect to %s!\n", so->rdests[i]); }
+				exit(EXIT_FAILURE);
+			}
+		}
+		z = rais_build(&rt->rs);
+		if(z) {
+			fprintf(stderr, "rais_build() failed! (%d)\n", z);
+			exit(EXIT_FAILURE);
+		}
+		rt->sharded = 1;
+	} else {
+		z = raip_connect(&rt->rp, so->rpool, so->rdest, so->rport);
+	}
 	if(z) {
 		if(so->rport) { fprintf(stderr, "Failed to connect to %s:%u!\n", so->rdest, so->rport); }
 		else { fprintf(stderr, "Failed to connect to %s!\n", so->rdest); }
 		exit(EXIT_FAILURE);
 	}
 
+	// Connect to the read replicas, the primary still takes every write
+	if(so->rrcount > 0) {
+		for(i=0; i<so->rrcount; i++) {
+			z = rair_add(&rt->rr, so->rrdests[i], so->rrports[i], so->rpool);
+			if(z) {
+				if(so->rrports[i]) { fprintf(stderr, "Failed to connect to replica %s:%u!\n", so->rrdests[i], so->rrports[i]); }
+				else { fprintf(stderr, "Failed to connect to replica %s!\n", so->rrdests[i]); }
+				exit(EXIT_FAILURE);
+			}
+		}
+		rt->rr.policy = so->rrpolicy;
+		rt->ryw = so->rryw;
+		rt->replicas = 1;
+	}
+
+	// Bound every redis round trip, a timed out context is reconnected with backoff
+	if(so->rtimeout > 0) {
+		if(rt->clustered) { raic_set_timeout(&rt->rc, so->rtimeout); }
+		else if(rt->sharded) { for(i=0; i<rt->rs.count; i++) { raip_set_timeout(&rt->rs.pools[i], so->rtimeout); } }
+		else { raip_set_timeout(&rt->rp, so->rtimeout); }
+		for(i=0; i<rt->rr.count; i++) { raip_set_timeout(&rt->rr.pools[i], so->rtimeout); }
+	}
+
+	// Fail requests fast with a 503 after rbreaker consecutive redis failures
+	raicb_init(&rt->cb, so->rbreaker, 1000);
+
+	// Group concurrent redis commands into pipelined batches
+	// Trade up to rwindow usec of latency for fewer round trips
+	if(so->rwindow > 0) {
+		z = raib_init(&rt->rb, &rt->rp, so->rwindow, so->rbatch, &handle_redis_error);
+		if(z) {
+			fprintf(stderr, "raib_init() failed! (%d)\n", z);
+			exit(EXIT_FAILURE);
+		}
+		rt->batching = 1;
+	}
+
+	// Connect to Redis a second time for non-blocking requests
+	// The pool is still used for connection limiting in ws_addr_check()
+	if(so->use_async) {
+		z = raia_connect(&rt->ra, so->rdest, so->rport, &handle_redis_async_error);
+		if(z) {
+			fprintf(stderr, "raia_connect() failed! (%d)\n", z);
+			exit(EXIT_FAILURE);
+		}
+		rt->async = 1;
+	}
+
 	// Initialize the server
-	g_rt.max_post_data_size = so->max_post_data_size;
-	g_srv = searest_new(8+3, 128+11, so->max_post_data_size);
-	searest_node_add(g_srv, "/config/",		&nodecfg, NULL);	// 8+3
-	searest_node_add(g_srv, "/store/128/",	&node128, NULL);	// 32+11
-	searest_node_add(g_srv, "/store/160/",	&node160, NULL);
-	searest_node_add(g_srv, "/store/224/",	&node224, NULL);
-	searest_node_add(g_srv, "/store/256/",	&node256, NULL);
-	searest_node_add(g_srv, "/store/384/",	&node384, NULL);
-	searest_node_add(g_srv, "/store/512/",	&node512, NULL);
+	rt->max_post_data_size = so->max_post_data_size;
+	srv = searest_new(7+3, 128+11, so->max_post_data_size);
+	searest_node_add(srv, "/config/",		&nodecfg, NULL);	// 8+3
+	searest_node_add(srv, "/batch/",		&nodebatch, NULL);	// 7+3
+	searest_node_add(srv, "/store/128/",	&node128, NULL);	// 32+11
+	searest_node_add(srv, "/store/160/",	&node160, NULL);
+	searest_node_add(srv, "/store/224/",	&node224, NULL);
+	searest_node_add(srv, "/store/256/",	&node256, NULL);
+	searest_node_add(srv, "/store/384/",	&node384, NULL);
+	searest_node_add(srv, "/store/512/",	&node512, NULL);
+
+	// Reject bad POSTs before their body is transferred
+	searest_node_set_precheck_cb(srv, "/store/128/",	&pre128);
+	searest_node_set_precheck_cb(srv, "/store/160/",	&pre160);
+	searest_node_set_precheck_cb(srv, "/store/224/",	&pre224);
+	searest_node_set_precheck_cb(srv, "/store/256/",	&pre256);
+	searest_node_set_precheck_cb(srv, "/store/384/",	&pre384);
+	searest_node_set_precheck_cb(srv, "/store/512/",	&pre512);
+
+	// Validate (and forward) uploads chunk by chunk, instead of after buffering them
+	if(so->stream) {
+		rt->stream = 1;
+		rt->sfwd = so->sfwd;
+		searest_node_set_upload_cb(srv, "/store/128/",	&upload_store);
+		searest_node_set_upload_cb(srv, "/store/160/",	&upload_store);
+		searest_node_set_upload_cb(srv, "/store/224/",	&upload_store);
+		searest_node_set_upload_cb(srv, "/store/256/",	&upload_store);
+		searest_node_set_upload_cb(srv, "/store/384/",	&upload_store);
+		searest_node_set_upload_cb(srv, "/store/512/",	&upload_store);
+	}
+
+	// Large objects are read from redis one window at a time as the client drains them
+	rt->sget = so->sget;
 
 	// Configure Multithread
-	if(so->use_threads == 0) { searest_set_internal_select(g_srv); }
+	if(so->tpool > 0) { searest_set_thread_pool(srv, so->tpool); }
+	else if(so->use_threads == 0) { searest_set_internal_select(srv); }
+
+	// Configure io_uring (one ring per thread of the pool)
+	if(so->uring && searest_set_engine_uring(srv)) {
+		fprintf(stderr, "webstore was built without io_uring support! (Fix by removing --uring)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// Configure Async (requests are suspended while waiting on redis)
+	if(rt->async) { searest_set_suspend_resume(srv); }
 
 	// Configure Connection Limiting
-	if(getenv("REQPERIOD")) { g_rt.reqperiod = atoi(getenv("REQPERIOD")); }
-	if(getenv("REQCOUNT")) { g_rt.reqcount = atol(getenv("REQCOUNT")); }
-	if((g_rt.reqperiod > 0) && (g_rt.reqcount > 0)) {
-		searest_set_addr_cb(g_srv, &ws_addr_check);
+	if(getenv("REQPERIOD")) { rt->reqperiod = atoi(getenv("REQPERIOD")); }
+	if(getenv("REQCOUNT")) { rt->reqcount = atol(getenv("REQCOUNT")); }
+	if((rt->reqperiod > 0) && (rt->reqcount > 0)) {
+		searest_set_addr_cb(srv, &ws_addr_check);
 	}
 
 	// Configure Redis Key Expiration
-	if(getenv("EXPIRATION")) { g_rt.expiration = atol(getenv("EXPIRATION")); }
-	if(g_rt.expiration < 0) { g_rt.expiration = 0; }
+	if(getenv("EXPIRATION")) { rt->expiration = atol(getenv("EXPIRATION")); }
+	if(rt->expiration < 0) { rt->expiration = 0; }
 
 	// Configure immutable messages
-	if(getenv("IMMUTABLE")) { g_rt.immutable = 1; }
+	if(getenv("IMMUTABLE")) { rt->immutable = 1; }
 
 	// Configure [B]urn [A]fter [R]eading (DELETE after GET)
-	if(getenv("BAR")) { g_rt.bar = 1; }
+	if(getenv("BAR")) { rt->bar = 1; }
+
+	// Remember immutable objects that exist for ICACHE seconds (never longer than EXPIRATION)
+	if(rt->immutable && getenv("ICACHE")) {
+		ttl = atol(getenv("ICACHE"));
+		if(rt->expiration && (ttl > rt->expiration)) { ttl = rt->expiration; }
+		if(ttl > 0) {
+			// The first daemon creates the cache, every other one shares it
+			if(!g_ic.slots) {
+				z = wsic_init(&g_ic, ttl);
+				if(z) {
+					fprintf(stderr, "wsic_init() failed! (%d)\n", z);
+					exit(EXIT_FAILURE);
+				}
+			}
+			rt->ic = &g_ic;
+			rt->icaching = 1;
+		}
+	}
+
+	// Prebuild our SET command now that the policy is known
+	post_template_init(rt);
+
+	// Load our server-side scripts
+	z = ws_redis_scripts_load(rt);
+	if(z) {
+		fprintf(stderr, "ws_redis_scripts_load() failed! (%d)\n", z);
+		exit(EXIT_FAILURE);
+	}
 
 	// Configure HTTPS
-	if(so->certfile && so->keyfile) { activate_https(so); }
+	if(so->certfile && so->keyfile) { activate_https(srv, so); }
+
+	// Share the port with the other daemons
+	if(so->daemons > 1) { searest_set_reuse_port(srv); }
+
+	// Extra listeners, a unix socket path can't be shared so it goes to the first daemon
+	for(i=0; i<so->lcount; i++) {
+		if((so->ldests[i][0] == '/') && (n > 0)) { continue; }
+		searest_add_listener(srv, so->ldests[i], so->lports[i]);
+	}
 
 	// Start the server
-	z = searest_start(g_srv, so->http_ip, so->http_port, &g_rt);
+	z = searest_start(srv, so->http_ip, so->http_port, rt);
 	if(z) {
 		if(!so->http_ip) { so->http_ip="*"; }
-		fprintf(stderr, "searest_start() failed to bind to %s:%u!\n", so->http_ip, so->http_port);
+		fprintf(stderr, "searest_start() failed to bind to %s:%u", so->http_ip, so->http_port);
+		for(i=0; i<so->lcount; i++) {
+			if(so->lports[i]) { fprintf(stderr, " / %s:%u", so->ldests[i], so->lports[i]); }
+			else { fprintf(stderr, " / %s", so->ldests[i]); }
+		}
+		fprintf(stderr, "! (%d)\n", z);
 		exit(EXIT_FAILURE);
 	}
 
+	return srv;
+}
+
+void webstore_start(srv_opts_t *so)
+{
+	int i;
+
+	// With more than one daemon, the kernel spreads new connections across them (SO_REUSEPORT)
+	g_daemons = (so->daemons > 1) ? so->daemons : 1;
+	for(i=0; i<g_daemons; i++) {
+		g_srv[i] = ws_instance_start(so, &g_rt[i], i);
+	}
+
 	// Log the success
-	log_add(WSLOG_INFO, "webstore started on port %u", so->http_port);
+	if(g_daemons > 1) { log_add(WSLOG_INFO, "webstore started %d daemons on port %u", g_daemons, so->http_port); }
+	else { log_add(WSLOG_INFO, "webstore started on port %u", so->http_port); }
 	log_flush();
 }
 
+// Log how often each store node was used, summed over every daemon
+static void log_node_access(void)
+{
+	int i, j;
+	unsigned long count;
+	time_t t, last;
+	char *nodes[] = { "/store/128/", "/store/160/", "/store/224/", "/store/256/", "/store/384/", "/store/512/" };
+
+	for(j=0; j<sizeof(nodes)/sizeof(nodes[0]); j++) {
+		count = 0;
+		last = 0;
+		for(i=0; i<g_daemons; i++) {
+			if(!g_srv[i]) { continue; }
+			count += searest_node_get_access_count(g_srv[i], nodes[j]);
+			t = searest_node_get_last_access(g_srv[i], nodes[j]);
+			if(t > last) { last = t; }
+		}
+		if(count > 0) { log_add(WSLOG_INFO, "%s served %lu requests (last at %ld)", nodes[j], count, (long)last); }
+	}
+}
+
 void webstore_stop(void)
 {
-	if(g_srv) {
-		searest_stop(g_srv);
-		searest_del(g_srv);
-		log_add(WSLOG_INFO, "webstore shutdown");
-		rai_disconnect(&g_rt.rc);
+	int i;
+	wsrt_t *rt;
+
+	log_node_access();
+	for(i=0; i<g_daemons; i++) {
+		if(!g_srv[i]) { continue; }
+		rt = &g_rt[i];
+		// Flush all pending async requests before we stop the server
+		// Any suspended connections will be resumed with a 503
+		if(rt->async) { raia_disconnect(&rt->ra); }
+		searest_stop(g_srv[i]);
+		searest_del(g_srv[i]);
+		g_srv[i] = NULL;
+		if(rt->batching) { raib_destroy(&rt->rb); }
+		if(rt->replicas) { rair_disconnect(&rt->rr); }
+		if(rt->clustered) { raic_disconnect(&rt->rc); }
+		else if(rt->sharded) { rais_disconnect(&rt->rs); }
+		else { raip_disconnect(&rt->rp); }
 	}
+	if(g_ic.slots) { wsic_free(&g_ic); }
+	if(g_daemons > 0) { log_add(WSLOG_INFO, "webstore shutdown"); }
+	g_daemons = 0;
 }